@@ -0,0 +1,501 @@
+#ifdef _MSC_VER // /Wall is very useful but yet a bit overreaching:
+#pragma warning(disable: 4820) // 'bytes' bytes padding added after construct 'name'
+#pragma warning(disable: 5045) // Spectre mitigation for memory load
+#pragma warning(disable: 4710) // function not inlined
+#pragma warning(disable: 4711) // function selected for automatic inline expansion
+#endif
+
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // before any system header: ftruncate() in rt.h
+#endif
+
+#include "rt.h"
+#include <time.h>
+
+// micro benchmarks need access to the lz77 internal stages:
+#define lz77_implementation
+#include "lz77.h"
+
+enum { bench_tokens = 4 * 1024 * 1024, bench_repeat = 5 };
+
+static double seconds(void) {
+    struct timespec ts = {0};
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t random64(uint64_t* state) { // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+typedef struct sink_s { // memory sink for 64-bit words
+    uint8_t* data;
+    size_t   bytes;
+    size_t   capacity;
+} sink_t;
+
+static void sink_write(lz77_t* lz, uint64_t b64) {
+    sink_t* sink = (sink_t*)lz->that;
+    if (sink->bytes + sizeof(b64) > sink->capacity) {
+        lz->error = ENOBUFS;
+    } else {
+        memcpy(sink->data + sink->bytes, &b64, sizeof(b64));
+        sink->bytes += sizeof(b64);
+    }
+}
+
+typedef struct token_s {
+    uint32_t pos; // zero for literal
+    uint32_t len; // or literal byte
+} token_t;
+
+// The bit at a time writer lz77.h used before: reference for output
+// identity and the baseline to measure against.
+
+static inline void per_bit_write_bit(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t bit) {
+    if (*bp == 64) {
+        lz->write(lz, *b64);
+        *b64 = 0;
+        *bp = 0;
+        lz->written += 8;
+    }
+    *b64 |= bit << *bp;
+    (*bp)++;
+}
+
+static inline void per_bit_write_bits(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t bits, uint32_t n) {
+    while (n > 0) {
+        per_bit_write_bit(lz, b64, bp, bits & 1);
+        bits >>= 1;
+        n--;
+    }
+}
+
+static inline void per_bit_write_number(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t bits, uint8_t base) {
+    do {
+        per_bit_write_bits(lz, b64, bp, bits, base);
+        bits >>= base;
+        per_bit_write_bit(lz, b64, bp, bits != 0); // stop bit
+    } while (bits != 0);
+}
+
+static void per_bit_emit(lz77_t* lz, const token_t* t, size_t n,
+        uint8_t base) {
+    uint64_t b64 = 0;
+    uint32_t bp = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (t[i].pos == 0) {
+            const uint8_t b = (uint8_t)t[i].len;
+            if (b < 0x80) {
+                per_bit_write_bit(lz, &b64, &bp, 0);
+            } else {
+                per_bit_write_bits(lz, &b64, &bp, 0b01, 2);
+            }
+            per_bit_write_bits(lz, &b64, &bp, b, 7);
+        } else {
+            per_bit_write_bits(lz, &b64, &bp, 0b11, 2);
+            per_bit_write_number(lz, &b64, &bp, t[i].pos, base);
+            per_bit_write_number(lz, &b64, &bp, t[i].len, base);
+        }
+    }
+    if (bp > 0) { lz->write(lz, b64); lz->written += 8; }
+}
+
+static void word_emit(lz77_t* lz, const token_t* t, size_t n, uint8_t base) {
+    uint64_t b64 = 0;
+    uint32_t bp = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (t[i].pos == 0) {
+            lz77_write_literal(lz, &b64, &bp, (uint8_t)t[i].len);
+        } else {
+            lz77_write_match(lz, &b64, &bp, t[i].pos, t[i].len, base);
+        }
+    }
+    if (bp > 0) { lz->write(lz, b64); lz->written += 8; }
+}
+
+typedef void (*emit_t)(lz77_t* lz, const token_t* t, size_t n, uint8_t base);
+
+static double bench_emit(emit_t emit, sink_t* sink, const token_t* tokens,
+        size_t n, uint8_t base) {
+    double best = 0;
+    for (int32_t r = 0; r < bench_repeat; r++) {
+        sink->bytes = 0;
+        lz77_t lz = { .that = sink, .write = sink_write };
+        const double start = seconds();
+        emit(&lz, tokens, n, base);
+        const double elapsed = seconds() - start;
+        rt_swear(lz.error == 0);
+        if (r == 0 || elapsed < best) { best = elapsed; }
+    }
+    return best;
+}
+
+// Encoder output stage alone: the same token stream (60% literals,
+// 10% of them >= 0x80, matches with distances and lengths skewed
+// to small values like in real texts) goes through both writers.
+
+static void bench_writer(uint8_t window_bits) {
+    const uint8_t base = (window_bits - 4) / 2;
+    const uint32_t window = ((uint32_t)1U) << window_bits;
+    token_t* tokens = (token_t*)malloc(bench_tokens * sizeof(token_t));
+    rt_swear(tokens != null);
+    uint64_t state = 0x1234567890ABCDEFULL;
+    for (size_t i = 0; i < bench_tokens; i++) {
+        const uint64_t r = random64(&state);
+        if (r % 10 < 6) {
+            tokens[i].pos = 0;
+            tokens[i].len = (uint32_t)((r >> 8) % 10 == 0 ?
+                0x80 | (r >> 16) : (r >> 16) & 0x7F);
+        } else {
+            tokens[i].pos = 1 + (uint32_t)((r >> 8) % (window - 1) >>
+                                            ((r >> 40) % window_bits));
+            tokens[i].len = 3 + (uint32_t)((r >> 48) % 64 >> ((r >> 56) % 4));
+        }
+    }
+    sink_t expected = {0};
+    sink_t actual = {0};
+    expected.capacity = bench_tokens * 64;
+    actual.capacity = bench_tokens * 64;
+    expected.data = (uint8_t*)malloc(expected.capacity);
+    actual.data = (uint8_t*)malloc(actual.capacity);
+    rt_swear(expected.data != null && actual.data != null);
+    const double per_bit = bench_emit(per_bit_emit, &expected,
+                                      tokens, bench_tokens, base);
+    const double word = bench_emit(word_emit, &actual,
+                                   tokens, bench_tokens, base);
+    rt_swear(expected.bytes == actual.bytes &&
+             memcmp(expected.data, actual.data, actual.bytes) == 0,
+             "output must be byte identical");
+    const double bits = (double)actual.bytes * 8;
+    rt_println("window_bits: %2d %6.1f Mbits per bit: %6.3f bits/ns "
+               "word: %6.3f bits/ns %5.2fx", window_bits, bits / 1e6,
+               bits / (per_bit * 1e9), bits / (word * 1e9), per_bit / word);
+    free(actual.data);
+    free(expected.data);
+    free(tokens);
+}
+
+// Match length kernels on long matches: the repeated "\x01\x02\x03\x04"
+// buffer of test.c compared with itself 4 bytes apart at lengths from
+// short to very long. Every kernel must return the same lengths.
+
+typedef struct kernel_s {
+    const char* name;
+    lz77_match_length_t match;
+} kernel_t;
+
+static double bench_kernel(lz77_match_length_t match, const uint8_t* data,
+        size_t bytes, size_t len, double* compared) {
+    double best = 0;
+    for (int32_t r = 0; r < bench_repeat; r++) {
+        size_t calls = 0;
+        size_t matched = 0;
+        const double start = seconds();
+        for (size_t k = 0; k + 64 + len + 4 <= bytes; k += len / 2 + 1) {
+            const uint8_t* a = data + k + k % 61; // unaligned starts
+            matched += match(a, a + 4, len);
+            calls++;
+        }
+        const double elapsed = seconds() - start;
+        rt_swear(matched == calls * len);
+        *compared = (double)matched * 2;
+        if (r == 0 || elapsed < best) { best = elapsed; }
+    }
+    return best;
+}
+
+static void bench_match(void) {
+    enum { bytes = 4 * 1024 * 1024 };
+    uint8_t* data = (uint8_t*)malloc(bytes);
+    rt_swear(data != null);
+    for (size_t i = 0; i < bytes; i += 4) { memcpy(data + i, "\x01\x02\x03\x04", 4); }
+    kernel_t kernels[4] = {
+        { "bytes", lz77_match_length_bytes },
+        { "words", lz77_match_length_words },
+    };
+    int32_t count = 2;
+    #ifdef lz77_simd
+    kernels[count++] = (kernel_t){ "sse2", lz77_match_length_sse2 };
+    if (lz77_has_avx2()) {
+        kernels[count++] = (kernel_t){ "avx2", lz77_match_length_avx2 };
+    }
+    #endif
+    for (size_t len = 16; len <= 64 * 1024; len *= 4) {
+        char line[256];
+        int32_t n = snprintf(line, sizeof(line), "match length: %6d", (int)len);
+        double scalar = 0;
+        for (int32_t i = 0; i < count; i++) {
+            double compared = 0; // bytes
+            const double t = bench_kernel(kernels[i].match, data, bytes, len,
+                                          &compared);
+            if (i == 0) { scalar = t; }
+            n += snprintf(line + n, sizeof(line) - n, " %s: %6.2f GB/s %5.2fx",
+                          kernels[i].name, compared / (t * 1e9), scalar / t);
+        }
+        rt_println("%s", line);
+    }
+    free(data);
+}
+
+// Throughput suite: compress and decompress MB/s (best and median of
+// bench_repeat runs), ratio and bits per literal and per match for
+// every corpus and window_bits [10..20]. Corpora are generated and
+// deterministic. Output is CSV or JSON lines for tracking regressions.
+
+enum { corpus_bytes = 1024 * 1024 };
+
+static const char* words[] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as",
+    "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+    "his", "from", "at", "which", "but", "have", "an", "had", "they",
+    "you", "were", "their", "one", "all", "we", "can", "her", "has",
+    "there", "been", "if", "more", "when", "will", "would", "who", "so",
+    "compression", "window", "dictionary", "literal", "distance", "match",
+    "stream", "block", "entropy", "sequence", "repository", "benchmark"
+};
+
+static const char* keywords[] = {
+    "static", "const", "uint8_t", "uint32_t", "size_t", "return", "if",
+    "else", "for", "while", "void", "bool", "struct", "typedef", "null",
+    "data", "bytes", "count", "error", "lz", "window_bits", "memcpy"
+};
+
+enum {
+    words_count = sizeof(words) / sizeof(words[0]),
+    keywords_count = sizeof(keywords) / sizeof(keywords[0])
+};
+
+static void corpus_text(uint8_t* data, size_t bytes, uint64_t* state) {
+    size_t i = 0;
+    size_t sentence = 0;
+    while (i < bytes) {
+        const uint64_t r = random64(state);
+        // skewed to frequent words: min of two uniform picks
+        const size_t a = (size_t)(r % words_count);
+        const size_t b = (size_t)((r >> 16) % words_count);
+        const char* w = words[a < b ? a : b];
+        for (size_t k = 0; w[k] != 0 && i < bytes; k++) {
+            data[i++] = sentence == 0 && k == 0 ? (uint8_t)(w[k] - 32) : (uint8_t)w[k];
+        }
+        sentence++;
+        if (i < bytes && (r >> 32) % 12 == 0) {
+            data[i++] = (r >> 40) % 5 == 0 ? '\n' : '.';
+            sentence = 0;
+        } else if (i < bytes && (r >> 32) % 17 == 0) {
+            data[i++] = ',';
+        }
+        if (i < bytes) { data[i++] = ' '; }
+    }
+}
+
+static void corpus_source(uint8_t* data, size_t bytes, uint64_t* state) {
+    size_t i = 0;
+    uint32_t indent = 0;
+    while (i < bytes) {
+        const uint64_t r = random64(state);
+        char line[128];
+        const char* k0 = keywords[r % keywords_count];
+        const char* k1 = keywords[(r >> 8) % keywords_count];
+        const char* k2 = keywords[(r >> 16) % keywords_count];
+        int32_t n = 0;
+        switch ((r >> 24) % 4) {
+            case 0: n = snprintf(line, sizeof(line), "%*s%s %s = %s(%s, %d);\n",
+                                 indent * 4, "", k0, k1, k2, k0, (int)(r >> 32) % 100);
+                    break;
+            case 1: n = snprintf(line, sizeof(line), "%*s%s (%s < %s) {\n",
+                                 indent * 4, "", k0, k1, k2);
+                    indent += indent < 4;
+                    break;
+            case 2: n = snprintf(line, sizeof(line), "%*s}\n",
+                                 indent * 4, "");
+                    indent -= indent > 0;
+                    break;
+            default: n = snprintf(line, sizeof(line), "%*s// %s %s %s\n",
+                                  indent * 4, "", k2, k1, k0);
+                    break;
+        }
+        for (int32_t k = 0; k < n && i < bytes; k++) { data[i++] = (uint8_t)line[k]; }
+    }
+}
+
+static void corpus_binary(uint8_t* data, size_t bytes, uint64_t* state) {
+    // records of: id (incrementing), timestamp (small deltas),
+    // 16-bit category, float value and 4 bytes of noise
+    uint32_t id = 1000;
+    uint32_t time = 1700000000;
+    for (size_t i = 0; i < bytes; i += 20) {
+        const uint64_t r = random64(state);
+        uint8_t record[20];
+        const uint16_t category = (uint16_t)((r % 8) * 257);
+        const float value = (float)(r >> 40) / 1024.0f;
+        const uint32_t noise = (uint32_t)(r >> 8);
+        time += (uint32_t)((r >> 20) % 16);
+        memcpy(record + 0, &id, 4);
+        memcpy(record + 4, &time, 4);
+        memcpy(record + 8, &category, 2);
+        memset(record + 10, 0x00, 2);
+        memcpy(record + 12, &value, 4);
+        memcpy(record + 16, &noise, 4);
+        const size_t n = bytes - i < sizeof(record) ? bytes - i : sizeof(record);
+        memcpy(data + i, record, n);
+        id++;
+    }
+}
+
+static void corpus_random(uint8_t* data, size_t bytes, uint64_t* state) {
+    for (size_t i = 0; i < bytes; i++) { data[i] = (uint8_t)(random64(state) >> 56); }
+}
+
+static void corpus_repetitive(uint8_t* data, size_t bytes, uint64_t* state) {
+    // the "\x01\x02\x03\x04" pattern of test.c with rare mutations
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (uint8_t)(1 + i % 4);
+        if (random64(state) % 4096 == 0) { data[i] = (uint8_t)(random64(state) >> 56); }
+    }
+}
+
+typedef struct corpus_s {
+    const char* name;
+    void (*generate)(uint8_t* data, size_t bytes, uint64_t* state);
+} corpus_t;
+
+static const corpus_t corpora[] = {
+    { "text",       corpus_text       },
+    { "source",     corpus_source     },
+    { "binary",     corpus_binary     },
+    { "random",     corpus_random     },
+    { "repetitive", corpus_repetitive }
+};
+
+typedef struct tokens_s {
+    uint64_t literals;
+    uint64_t matches;
+    uint64_t literal_bits;
+    uint64_t match_bits;
+} tokens_t;
+
+// walks tokens of the compress_level() output with the decoder stages
+static tokens_t bench_tokens_of(const uint8_t* compressed, size_t bytes) {
+    tokens_t t = {0};
+    lz77_t lz = { .buffer = (uint8_t*)compressed, .bytes = bytes };
+    const uint64_t n = lz77_read_word(&lz);
+    (void)lz77_read_word(&lz);
+    uint64_t b64 = 0;
+    uint32_t bp = 0;
+    const uint8_t window_bits =
+        (uint8_t)(lz77_read_bits(&lz, &b64, &bp, 8) & 0x1F);
+    const uint8_t base = (window_bits - 4) / 2;
+    uint64_t i = 0;
+    while (i < n && lz.error == 0) {
+        const uint16_t e = lz77_read_prefix(&lz, &b64, &bp);
+        if ((e >> 8) != lz77_prefix_match) {
+            t.literals++;
+            t.literal_bits += e >> 8;
+            i++;
+        } else {
+            const uint64_t pos = lz77_read_number(&lz, &b64, &bp, base);
+            const uint64_t len = lz77_read_number(&lz, &b64, &bp, base);
+            t.matches++;
+            t.match_bits += lz77_match_bits((size_t)pos, (size_t)len, base);
+            i += len;
+        }
+    }
+    rt_swear(lz.error == 0 && i == n);
+    return t;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void bench_suite(bool json, uint8_t level) {
+    const size_t capacity = lz77.compress_bound(corpus_bytes);
+    uint8_t* data = (uint8_t*)malloc(corpus_bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(corpus_bytes);
+    rt_swear(data != null && compressed != null && decompressed != null);
+    if (!json) {
+        printf("corpus,window_bits,level,bytes,compressed,ratio,"
+               "compress_mbs_best,compress_mbs_median,"
+               "decompress_mbs_best,decompress_mbs_median,"
+               "literals,matches,bits_per_literal,bits_per_match\n");
+    }
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+        uint64_t state = 0x9E3779B97F4A7C15ULL + c;
+        corpora[c].generate(data, corpus_bytes, &state);
+        for (uint8_t window_bits = 10; window_bits <= 20; window_bits++) {
+            double ct[bench_repeat];
+            double dt[bench_repeat];
+            size_t written = 0;
+            for (int32_t r = 0; r < bench_repeat; r++) {
+                lz77_t lz = { .buffer = compressed, .capacity = capacity };
+                double start = seconds();
+                lz77.write_header(&lz, corpus_bytes, window_bits);
+                lz77.compress_level(&lz, data, corpus_bytes, window_bits, level);
+                ct[r] = seconds() - start;
+                rt_swear(lz.error == 0);
+                written = lz.bytes;
+                size_t n = 0;
+                start = seconds();
+                const errno_t e = lz77.decompress_buffer(decompressed,
+                    corpus_bytes, compressed, written, &n);
+                dt[r] = seconds() - start;
+                rt_swear(e == 0 && n == corpus_bytes &&
+                         memcmp(data, decompressed, n) == 0);
+            }
+            qsort(ct, bench_repeat, sizeof(ct[0]), compare_doubles);
+            qsort(dt, bench_repeat, sizeof(dt[0]), compare_doubles);
+            const tokens_t t = bench_tokens_of(compressed, written);
+            const double mb = corpus_bytes / 1e6;
+            const double ratio = (double)written / corpus_bytes;
+            const double bpl = t.literals > 0 ? (double)t.literal_bits / t.literals : 0;
+            const double bpm = t.matches > 0 ? (double)t.match_bits / t.matches : 0;
+            const char* format = json ?
+                "{\"corpus\":\"%s\",\"window_bits\":%d,\"level\":%d,"
+                "\"bytes\":%d,\"compressed\":%d,\"ratio\":%.4f,"
+                "\"compress_mbs_best\":%.2f,\"compress_mbs_median\":%.2f,"
+                "\"decompress_mbs_best\":%.2f,\"decompress_mbs_median\":%.2f,"
+                "\"literals\":%lld,\"matches\":%lld,"
+                "\"bits_per_literal\":%.3f,\"bits_per_match\":%.3f}\n" :
+                "%s,%d,%d,%d,%d,%.4f,%.2f,%.2f,%.2f,%.2f,%lld,%lld,%.3f,%.3f\n";
+            printf(format, corpora[c].name, window_bits, level,
+                   (int)corpus_bytes, (int)written, ratio,
+                   mb / ct[0], mb / ct[bench_repeat / 2],
+                   mb / dt[0], mb / dt[bench_repeat / 2],
+                   (long long)t.literals, (long long)t.matches, bpl, bpm);
+            fflush(stdout);
+        }
+    }
+    free(decompressed);
+    free(compressed);
+    free(data);
+}
+
+// usage: bench [micro | csv | json] [level]
+// without arguments runs micro benchmarks and the suite in CSV
+
+int main(int argc, const char* argv[]) {
+    const char* mode = argc > 1 ? argv[1] : "";
+    const int level = argc > 2 ? atoi(argv[2]) : lz77_level_default;
+    rt_swear(lz77_level_min <= level && level <= lz77_level_max);
+    const bool all = mode[0] == 0;
+    if (all || strcmp(mode, "micro") == 0) {
+        for (uint8_t window_bits = 10; window_bits <= 20; window_bits += 2) {
+            bench_writer(window_bits);
+        }
+        bench_match();
+    }
+    if (all || strcmp(mode, "csv") == 0 || strcmp(mode, "json") == 0) {
+        bench_suite(strcmp(mode, "json") == 0, (uint8_t)level);
+    }
+    return 0;
+}
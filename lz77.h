@@ -2,32 +2,274 @@
 #define lz77_definition
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#if !defined(_MSC_VER) && !defined(__STDC_LIB_EXT1__)
+typedef int errno_t; // Microsoft and C11 Annex K
+#endif
+
 // Naive LZ77 implementation inspired by CharGPT discussion
 // and my personal passion to compressors in 198x
 
 typedef struct lz77_s lz77_t;
 
+typedef struct lz77_dictionary_s lz77_dictionary_t; // see dictionary_create()
+typedef struct lz77_context_s lz77_context_t; // see context_bytes()
+
+typedef struct lz77_message_s { // see compress_batch()
+    const uint8_t* data;
+    size_t         bytes;
+    uint8_t*       compressed;
+    size_t         capacity;
+    size_t         written; // out: compressed bytes
+    errno_t        error;   // out: of this message
+} lz77_message_t;
+
+// Optional per instance statistics collected into lz77_t.stats when
+// the implementation is compiled with `lz77_statistics` defined and
+// not compiled at all otherwise. Counters accumulate over calls.
+// Times are wall clock summed over compress_parallel() threads.
+// Decompression fills token counters and io_ns only.
+
+typedef struct lz77_stats_s {
+    uint64_t literals[2];  // bytes < 0x80 and >= 0x80
+    uint64_t matches;
+    uint64_t len[64];      // matches by bit length of their length
+    uint64_t pos[64];      // and of their coded distance, see lz77_reps
+    uint64_t literal_bits; // emitted or consumed by tokens of the class
+    uint64_t match_bits;
+    uint64_t probes;       // match candidates examined
+    uint64_t search_ns;    // time in the match finder
+    uint64_t emit_ns;      // parsing and writing tokens less search
+    uint64_t io_ns;        // in read(), write(), read_block(), write_block()
+} lz77_stats_t;
+
 typedef struct lz77_s {
     void*    that;  // caller supplied data
     errno_t  error; // sticky; for read()/write() compress() and decompress()
     // caller supplied read()/write() must error via .error field
     uint64_t (*read)(lz77_t*); //  reads 64 bits
     void     (*write)(lz77_t*, uint64_t b64); // writes 64 bits
-    uint64_t written;
+    uint64_t written;  // bytes
+    uint64_t consumed; // bytes
+    // Optional block interface instead of read()/write(): the codec
+    // batches 64-bit words in caller supplied `buffer` of `capacity`
+    // bytes (at least 8) and calls read_block()/write_block() only
+    // when it is empty/full. read_block() returns number of bytes read
+    // (zero at the end of data) and may read ahead of the compressed
+    // stream. compress() flushes buffered words on return.
+    // With no callbacks at all `buffer` is the whole in memory stream:
+    // writes fail with ENOBUFS past `capacity` and reads with ENODATA
+    // past `bytes`.
+    size_t   (*read_block)(lz77_t*, void* data, size_t bytes);
+    void     (*write_block)(lz77_t*, const void* data, size_t bytes);
+    uint8_t* buffer;
+    size_t   capacity;
+    size_t   bytes;    // buffered bytes
+    size_t   position; // of next byte to read in buffer
+    struct lz77_encoder_s* encoder; // compress_begin() .. compress_finish()
+    struct lz77_decoder_s* decoder; // decompress_begin() .. decompress_finish()
+    struct lz77_pipe_s*    pipe;    // pipe_begin() .. pipe_end()
+    lz77_stats_t* stats; // optional, set before compress or decompress calls
+    // Set before compress_begin() or compress_parallel() to add XXH64
+    // based checksums of uncompressed bytes to every block and to the
+    // whole stream, before compress() or compress_level() to append
+    // XXH64 of the message (see also compress_buffer_ex()). Decoders
+    // verify the checksums present in a stream and fail with EBADMSG
+    // on mismatch.
+    bool checksum;
 } lz77_t;
 
+enum { // compression levels trade speed for output size:
+    lz77_level_min     = 1, // [1..3] greedy parsing
+    lz77_level_default = 5, // [4..6] lazy matching
+    lz77_level_max     = 9  // [7..9] optimal parsing priced in bits
+};
+
+enum { lz77_window_auto = 0 }; // window_bits, see auto_window_bits()
+
 typedef struct lz77_if {
     // `window_bits` is a log2 of window size in bytes must be in range [10..20]
+    // or [10..30] for write_header(), compress(), compress_level() and
+    // decompress(). Windows over 1MB add far matching over a sparse index
+    // of 4 << lz77_far_index_bits bytes (16MB unless defined otherwise).
+    // Far matching is single format only: streams of blocks, parallel
+    // compression, dictionaries, contexts and batches fail with EINVAL
+    // on window_bits over 20.
     void (*write_header)(lz77_t* lz77, size_t bytes, uint8_t window_bits);
     void (*compress)(lz77_t* lz77, const uint8_t* data, size_t bytes,
-                     uint8_t window_bits);
+                     uint8_t window_bits); // at lz77_level_default
+    // `level` must be in range [lz77_level_min..lz77_level_max]
+    void (*compress_level)(lz77_t* lz77, const uint8_t* data, size_t bytes,
+                           uint8_t window_bits, uint8_t level);
     void (*read_header)(lz77_t* lz77, size_t *bytes, uint8_t *window_bits);
     void (*decompress)(lz77_t* lz77, uint8_t* data, size_t bytes,
                        uint8_t window_bits);
     // Writing and reading envelope of source data `bytes` and
     // `window_bits` is caller's responsibility.
+    // Memory to memory without callbacks. Output of compress_buffer()
+    // is header followed by compressed data. It fails with ENOBUFS if
+    // `capacity` is less than needed; compress_bound() is sufficient
+    // for both compress_buffer() and streaming compression. Messages
+    // that do not shrink are stored: output of compress_buffer(),
+    // compress_context() and compress_batch() is at most 24 bytes
+    // more than the message padded to a multiple of 8.
+    size_t  (*compress_bound)(size_t bytes);
+    errno_t (*compress_buffer)(uint8_t* compressed, size_t capacity,
+                               const uint8_t* data, size_t bytes,
+                               uint8_t window_bits, size_t *written);
+    // compress_buffer() that with `checksum` appends XXH64 of the
+    // message (8 bytes more) verified by all the decoders.
+    errno_t (*compress_buffer_ex)(uint8_t* compressed, size_t capacity,
+                                  const uint8_t* data, size_t bytes,
+                                  uint8_t window_bits, bool checksum,
+                                  size_t *written);
+    errno_t (*decompress_buffer)(uint8_t* data, size_t capacity,
+                                 const uint8_t* compressed, size_t bytes,
+                                 size_t *decompressed);
+    // Streaming compression of input in chunks of any size with total
+    // size not known up front. Memory use is O(window) not O(input).
+    // Output is header and self terminated sequence of blocks that
+    // decompress_buffer() can read. compress_finish() must be called
+    // even after an error to release the memory.
+    void (*compress_begin)(lz77_t* lz77, uint8_t window_bits, uint8_t level);
+    void (*compress_update)(lz77_t* lz77, const uint8_t* data, size_t bytes);
+    void (*compress_finish)(lz77_t* lz77);
+    // Streaming decompression of either format with memory use of
+    // about 2 x window (at least window + 64KB) whatever the output
+    // size is. decompress_begin() reads the header. Output is either
+    // pulled by decompress_read() that returns number of bytes placed
+    // into `data` (less than `bytes` only at the end of the stream or
+    // on error) or pushed to `sink` in chunks by decompress_stream()
+    // until the end of the stream. decompress_finish() must be called
+    // even after an error to release the memory.
+    void   (*decompress_begin)(lz77_t* lz77);
+    size_t (*decompress_read)(lz77_t* lz77, uint8_t* data, size_t bytes);
+    void   (*decompress_stream)(lz77_t* lz77,
+                void (*sink)(lz77_t* lz77, const uint8_t* data, size_t bytes));
+    void   (*decompress_finish)(lz77_t* lz77);
+    // Compresses data in memory as a stream of blocks of 1 << block_bits
+    // bytes on up to `threads` threads (the calling one included).
+    // `block_bits` must be in range [max(window_bits, 16)..30]. With
+    // `history` blocks use up to window preceding bytes as dictionary
+    // otherwise they are independent. Output depends on `block_bits`
+    // but not on `threads`. Callbacks, if any, are called from any of
+    // the threads one at a time.
+    void (*compress_parallel)(lz77_t* lz77, const uint8_t* data,
+                              size_t bytes, uint8_t window_bits,
+                              uint8_t level, uint8_t block_bits,
+                              bool history, uint32_t threads);
+    // compress_parallel() output ends with an index of blocks. With it
+    // decompress_range() decodes uncompressed bytes [from..to - 1] into
+    // `data` touching only the blocks covering the range (and the ones
+    // before them their history depends on). decompress_parallel()
+    // decodes independent blocks concurrently. Both fail with ENOTSUP
+    // on streams without index.
+    errno_t (*decompress_range)(uint8_t* data, const uint8_t* compressed,
+                                size_t bytes, uint64_t from, uint64_t to);
+    errno_t (*decompress_parallel)(uint8_t* data, size_t capacity,
+                                   const uint8_t* compressed, size_t bytes,
+                                   uint32_t threads, size_t *decompressed);
+    // Preset dictionary for small messages: the window starts primed
+    // with the last up to `window` bytes of `data` instead of empty.
+    // Match finder chains of the dictionary are built once by
+    // dictionary_create() and never modified afterwards, so the same
+    // dictionary may be used by any number of threads at once.
+    // Header of the output carries 32-bit dictionary_id() and only
+    // decompress_dictionary() with the same dictionary can decode it.
+    // compress_dictionary() and decompress_dictionary() are convenience
+    // wrappers that allocate a context for each message: services
+    // with many messages keep contexts and call compress_context() and
+    // decompress_context() instead.
+    errno_t  (*dictionary_create)(lz77_dictionary_t* *dictionary,
+                                  const uint8_t* data, size_t bytes,
+                                  uint8_t window_bits);
+    uint32_t (*dictionary_id)(const lz77_dictionary_t* dictionary);
+    void     (*dictionary_dispose)(lz77_dictionary_t* dictionary);
+    errno_t  (*compress_dictionary)(const lz77_dictionary_t* dictionary,
+                                    uint8_t* compressed, size_t capacity,
+                                    const uint8_t* data, size_t bytes,
+                                    uint8_t level, size_t *written);
+    errno_t  (*decompress_dictionary)(const lz77_dictionary_t* dictionary,
+                                      uint8_t* data, size_t capacity,
+                                      const uint8_t* compressed, size_t bytes,
+                                      size_t *decompressed);
+    // Trains dictionary of up to `capacity` bytes from `count` sample
+    // records concatenated in `samples` with sizes[i] bytes each:
+    // the segments sharing most substrings with other records.
+    errno_t  (*dictionary_train)(uint8_t* dictionary, size_t capacity,
+                                 const uint8_t* samples, const size_t* sizes,
+                                 size_t count, size_t *trained);
+    // Reusable compressor for many small messages: all working memory
+    // of `window_bits`, `level` and `history` is one block of exactly
+    // context_bytes() (zero for invalid parameters). It is either
+    // caller supplied 8 bytes aligned `memory` (context_init(), for
+    // pools; context_dispose() does not free it) or allocated by
+    // context_create(). Tables are not cleared between messages.
+    // With non null `dictionary` the message is copied behind the
+    // dictionary bytes (copied only when the dictionary is not the
+    // one already there) in the block: `history` is the most
+    // dictionary plus message bytes the context takes (zero without
+    // dictionaries); larger ones fail with EINVAL. Level zero makes
+    // a decoder context: no tables, only the history buffer.
+    // compress_context() output is the same as compress_buffer() or,
+    // with `dictionary`, compress_dictionary() at the level and
+    // decompress_context() decodes what decompress_dictionary() does.
+    // A context is used by one thread at a time.
+    // Output of contexts, compress_dictionary() and compress_batch()
+    // carries no checksum: small messages are better served by the
+    // checksum of the envelope they travel in.
+    size_t  (*context_bytes)(uint8_t window_bits, uint8_t level,
+                             size_t history);
+    errno_t (*context_init)(lz77_context_t* *context, void* memory,
+                            size_t bytes, uint8_t window_bits, uint8_t level,
+                            size_t history);
+    errno_t (*context_create)(lz77_context_t* *context, uint8_t window_bits,
+                              uint8_t level, size_t history);
+    void    (*context_dispose)(lz77_context_t* context);
+    errno_t (*compress_context)(lz77_context_t* context,
+                                const lz77_dictionary_t* dictionary,
+                                uint8_t* compressed, size_t capacity,
+                                const uint8_t* data, size_t bytes,
+                                size_t *written);
+    errno_t (*decompress_context)(lz77_context_t* context,
+                                  const lz77_dictionary_t* dictionary,
+                                  uint8_t* data, size_t capacity,
+                                  const uint8_t* compressed, size_t bytes,
+                                  size_t *decompressed);
+    // Pipelined block I/O: between pipe_begin() and pipe_end() either
+    // read_block() or write_block() (exactly one must be set) runs on
+    // its own thread reading ahead of the decoder or writing behind
+    // the encoder. `buffer` is split into `buffers` [2..3] slots of
+    // at least 8 bytes and the codec waits only when all of them are
+    // in flight. pipe_begin() must precede any I/O including headers.
+    // Callbacks get a copy of lz77_t with the same `that`
+    // and their errors are reported in lz77.error on the next block
+    // or by pipe_end() which waits for pending writes and discards
+    // data read ahead. Without threads I/O stays synchronous.
+    void (*pipe_begin)(lz77_t* lz77, uint32_t buffers);
+    void (*pipe_end)(lz77_t* lz77);
+    // Window bits [10..20] for the data: large enough to reach nearly
+    // all of its repeats but not larger, so that the match search and
+    // the decoder touch less memory. compress_buffer() and
+    // compress_parallel() call it for lz77_window_auto `window_bits`.
+    // Streams of blocks also choose the bases of numbers for each block
+    // on their own and record them in the block header.
+    uint8_t (*auto_window_bits)(const uint8_t* data, size_t bytes);
+    // Compresses `count` independent messages on up to `threads`
+    // threads. Each thread sets up one context of `window_bits` and
+    // `level` (and one copy of the optional dictionary) and reuses it
+    // for all the messages it takes. Threads take shrinking runs of
+    // messages so that the last ones finish at about the same time.
+    // Output of a message is the same as of compress_context() and
+    // its written bytes and error are set in its lz77_message_t.
+    // Returns the first message error or the error of the batch.
+    errno_t (*compress_batch)(const lz77_dictionary_t* dictionary,
+                              uint8_t window_bits, uint8_t level,
+                              lz77_message_t* messages, size_t count,
+                              uint32_t threads);
 } lz77_if;
 
 extern lz77_if lz77;
@@ -45,7 +287,47 @@ extern lz77_if lz77;
 #define lz77_println(...) do {] while (0)
 #endif
 
-#ifdef lz77_historgram
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(lz77_no_simd)
+#define lz77_simd // SSE2 and runtime detected AVX2 match length kernels
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__STDC_NO_THREADS__) && !defined(lz77_no_threads)
+#define lz77_no_threads // compress_parallel() falls back to one thread
+#endif
+
+#ifndef lz77_no_threads
+#include <threads.h>
+#endif
+
+#if defined(_MSC_VER)
+#define lz77_force_inline __forceinline
+#elif defined(__GNUC__)
+#define lz77_force_inline inline __attribute__((always_inline))
+#else
+#define lz77_force_inline inline
+#endif
+
+#ifndef lz77_alloc
+#include <stdlib.h>
+#define lz77_alloc(bytes) malloc(bytes)
+#define lz77_free(p)      free(p)
+#endif
+
+#ifdef lz77_statistics
+
+#include <time.h>
+
+static inline uint64_t lz77_nanoseconds(void) {
+    struct timespec ts = {0};
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
 static inline uint32_t lz77_bit_count(size_t v) {
     uint32_t count = 0;
@@ -53,76 +335,303 @@ static inline uint32_t lz77_bit_count(size_t v) {
     return count;
 }
 
-static size_t lz77_hist_len[64];
-static size_t lz77_hist_pos[64];
+#define lz77_stats_now(lz) ((lz)->stats != null ? lz77_nanoseconds() : 0)
 
-#define lz77_init_histograms() do {                             \
-    memset(lz77_hist_pos, 0x00, sizeof(lz77_hist_pos));         \
-    memset(lz77_hist_len, 0x00, sizeof(lz77_hist_len));         \
+#define lz77_stats_io(lz, start) do {                           \
+    if ((lz)->stats != null) {                                  \
+        (lz)->stats->io_ns += lz77_nanoseconds() - (start);     \
+    }                                                           \
 } while (0)
 
-#define lz77_histogram_pos_len(pos, len) do {                   \
-    lz77_hist_pos[lz77_bit_count(pos)]++;                       \
-    lz77_hist_len[lz77_bit_count(len)]++;                       \
+#define lz77_stats_literal(lz, b, bits) do {                    \
+    if ((lz)->stats != null) {                                  \
+        (lz)->stats->literals[(b) >> 7]++;                      \
+        (lz)->stats->literal_bits += (bits);                    \
+    }                                                           \
 } while (0)
 
-#define lz77_dump_histograms() do {                             \
-    lz77_println("Histogram log2(len):");                       \
-    for (int8_t i = 0; i < 64; i++) {                           \
-        if (lz77_hist_len[i] > 0) {                             \
-            lz77_println("len[%d]: %lld", i, lz77_hist_len[i]); \
-        }                                                       \
+#define lz77_stats_match(lz, distance, length, bits) do {       \
+    if ((lz)->stats != null) {                                  \
+        (lz)->stats->matches++;                                 \
+        (lz)->stats->pos[lz77_bit_count(distance)]++;           \
+        (lz)->stats->len[lz77_bit_count(length)]++;             \
+        (lz)->stats->match_bits += (bits);                      \
     }                                                           \
-    lz77_println("Histogram log2(pos):");                       \
-    for (int8_t i = 0; i < 64; i++) {                           \
-        if (lz77_hist_pos[i] > 0) {                             \
-            lz77_println("pos[%d]: %lld", i, lz77_hist_pos[i]); \
-        }                                                       \
+} while (0)
+
+// Emit stage is the time between lz77_stats_emit_begin() and
+// lz77_stats_emit_end() less the search and I/O inside of it.
+
+#define lz77_stats_emit_begin(lz) ((lz)->stats == null ? 0 :    \
+    lz77_nanoseconds() - (lz)->stats->search_ns - (lz)->stats->io_ns)
+
+#define lz77_stats_emit_end(lz, start) do {                     \
+    if ((lz)->stats != null) {                                  \
+        (lz)->stats->emit_ns += lz77_nanoseconds() -            \
+            (lz)->stats->search_ns - (lz)->stats->io_ns - (start); \
     }                                                           \
 } while (0)
 
+static void lz77_stats_merge(lz77_stats_t* to, const lz77_stats_t* from) {
+    uint64_t* d = (uint64_t*)to;
+    const uint64_t* s = (const uint64_t*)from;
+    for (size_t i = 0; i < sizeof(*to) / sizeof(uint64_t); i++) { d[i] += s[i]; }
+}
+
 #else
 
-#define lz77_init_histograms() do { } while (0)
-#define lz77_histogram_pos_len(pos, len) do { } while (0)
-#define lz77_dump_histograms() do { } while (0)
+#define lz77_stats_now(lz) 0
+#define lz77_stats_io(lz, start) do { (void)(start); } while (0)
+#define lz77_stats_literal(lz, b, bits) do { (void)(bits); } while (0)
+#define lz77_stats_match(lz, distance, length, bits) do { (void)(bits); } while (0)
+#define lz77_stats_emit_begin(lz) 0
+#define lz77_stats_emit_end(lz, start) do { (void)(start); } while (0)
 
 #endif
 
-static inline void lz77_write_bit(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint64_t bit) {
-    if (*bp == 64) {
-        lz->write(lz, *b64);
-        *b64 = 0;
-        *bp = 0;
-        lz->written += 8;
+// All codec I/O goes through lz77_write_word() and lz77_read_word():
+
+static void lz77_pipe_write(lz77_t* lz);
+static void lz77_pipe_read(lz77_t* lz);
+
+static void lz77_flush(lz77_t* lz) {
+    if (lz->write_block != null) {
+        if (lz->bytes > 0 && lz->error == 0) {
+            const uint64_t start = lz77_stats_now(lz);
+            if (lz->pipe != null) {
+                lz77_pipe_write(lz); // swaps lz->buffer
+            } else {
+                lz->write_block(lz, lz->buffer, lz->bytes);
+            }
+            lz77_stats_io(lz, start);
+        }
+        lz->bytes = 0;
+    }
+}
+
+static void lz77_overflow(lz77_t* lz) {
+    if (lz->write_block == null) {
+        lz->error = ENOBUFS; // in memory output is too small
+    } else if (lz->buffer == null || lz->capacity < sizeof(uint64_t)) {
+        lz->error = EINVAL;
+    } else {
+        lz77_flush(lz);
+    }
+}
+
+static inline void lz77_write_word(lz77_t* lz, uint64_t w) {
+    lz->written += sizeof(w);
+    if (lz->write != null && lz->write_block == null) {
+        const uint64_t start = lz77_stats_now(lz);
+        lz->write(lz, w);
+        lz77_stats_io(lz, start);
+    } else {
+        if (lz->bytes + sizeof(w) > lz->capacity) {
+            lz77_overflow(lz);
+            if (lz->error != 0) { return; }
+        }
+        memcpy(lz->buffer + lz->bytes, &w, sizeof(w));
+        lz->bytes += sizeof(w);
+    }
+}
+
+static uint64_t lz77_refill(lz77_t* lz) {
+    uint64_t w = 0;
+    if (lz->read_block == null) {
+        lz->error = ENODATA; // end of in memory input
+        return 0;
+    }
+    if (lz->buffer == null || lz->capacity < sizeof(w)) {
+        lz->error = EINVAL;
+        return 0;
+    }
+    size_t left = lz->bytes - lz->position;
+    if (lz->pipe != null) { // slots are whole words but the last one
+        if (left != 0) { lz->error = ENODATA; return 0; }
+        const uint64_t start = lz77_stats_now(lz);
+        lz77_pipe_read(lz); // next slot
+        lz77_stats_io(lz, start);
+        left = lz->bytes;
+    }
+    // stream is made of words but read_block() may return any count
+    memmove(lz->buffer, lz->buffer + lz->position, left);
+    lz->position = 0;
+    while (left < sizeof(w) && lz->error == 0 && lz->pipe == null) {
+        const uint64_t start = lz77_stats_now(lz);
+        const size_t n = lz->read_block(lz, lz->buffer + left,
+                                        lz->capacity - left);
+        lz77_stats_io(lz, start);
+        if (n == 0) { break; }
+        left += n;
+    }
+    lz->bytes = left;
+    if (lz->error == 0 && left < sizeof(w)) {
+        lz->error = ENODATA; // truncated stream
+    }
+    if (lz->error == 0) {
+        memcpy(&w, lz->buffer, sizeof(w));
+        lz->position = sizeof(w);
+    }
+    return w;
+}
+
+static inline uint64_t lz77_read_word(lz77_t* lz) {
+    uint64_t w = 0;
+    lz->consumed += sizeof(w);
+    if (lz->read != null && lz->read_block == null) {
+        const uint64_t start = lz77_stats_now(lz);
+        w = lz->read(lz);
+        lz77_stats_io(lz, start);
+    } else if (lz->position + sizeof(w) <= lz->bytes) {
+        memcpy(&w, lz->buffer + lz->position, sizeof(w));
+        lz->position += sizeof(w);
+    } else {
+        w = lz77_refill(lz);
+    }
+    return w;
+}
+
+// Stored blocks move whole words in bulk: data[0..bytes - 1] where
+// `bytes` is a multiple of 8.
+
+static void lz77_write_words(lz77_t* lz, const uint8_t* data, size_t bytes) {
+    rt_assert(bytes % sizeof(uint64_t) == 0);
+    if (lz->write != null && lz->write_block == null) {
+        for (size_t i = 0; i < bytes && lz->error == 0; i += 8) {
+            uint64_t w;
+            memcpy(&w, data + i, sizeof(w));
+            lz77_write_word(lz, w);
+        }
+        return;
+    }
+    while (bytes > 0 && lz->error == 0) {
+        if (lz->bytes + sizeof(uint64_t) > lz->capacity) {
+            lz77_overflow(lz);
+            if (lz->error != 0) { return; }
+        }
+        size_t n = (lz->capacity - lz->bytes) / 8 * 8;
+        if (n > bytes) { n = bytes; }
+        memcpy(lz->buffer + lz->bytes, data, n);
+        lz->bytes += n;
+        lz->written += n;
+        data += n;
+        bytes -= n;
+    }
+}
+
+static void lz77_read_words(lz77_t* lz, uint8_t* data, size_t bytes) {
+    rt_assert(bytes % sizeof(uint64_t) == 0);
+    while (bytes > 0 && lz->error == 0) {
+        size_t n = lz->read != null && lz->read_block == null ?
+                   0 : (lz->bytes - lz->position) / 8 * 8;
+        if (n == 0) { // read() callback or empty buffer
+            const uint64_t w = lz77_read_word(lz);
+            memcpy(data, &w, sizeof(w));
+            n = sizeof(w);
+        } else {
+            if (n > bytes) { n = bytes; }
+            memcpy(data, lz->buffer + lz->position, n);
+            lz->position += n;
+            lz->consumed += n;
+        }
+        data += n;
+        bytes -= n;
     }
-    *b64 |= bit << *bp;
-    (*bp)++;
 }
 
+// Bits are accumulated LSB first in *b64 with *bp (always < 64) bits
+// in use. Whole 64-bit words are handed to lz77_write_word() only when
+// the accumulator overflows.
+
 static inline void lz77_write_bits(lz77_t* lz, uint64_t* b64,
         uint32_t* bp, uint64_t bits, uint32_t n) {
-    rt_assert(n <= 64);
-    while (n > 0) {
-        lz77_write_bit(lz, b64, bp, bits & 1);
-        bits >>= 1;
-        n--;
+    rt_assert(n <= 64 && *bp < 64);
+    if (n < 64) { bits &= (((uint64_t)1) << n) - 1; }
+    *b64 |= bits << *bp;
+    const uint32_t used = *bp + n;
+    if (used < 64) {
+        *bp = used;
+    } else {
+        lz77_write_word(lz, *b64);
+        *b64 = *bp == 0 ? 0 : bits >> (64 - *bp); // bits that did not fit
+        *bp = used - 64;
     }
 }
 
+static inline void lz77_write_bit(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint64_t bit) {
+    lz77_write_bits(lz, b64, bp, bit, 1);
+}
+
 static inline void lz77_write_number(lz77_t* lz, uint64_t* b64,
         uint32_t* bp, uint64_t bits, uint8_t base) {
+    // `base` bits chunks each followed by the stop bit are gathered
+    // into a single lz77_write_bits() call while they fit into 64 bits
+    const uint64_t mask = (((uint64_t)1) << base) - 1;
+    uint64_t chunks = 0;
+    uint32_t n = 0;
     do {
-        lz77_write_bits(lz, b64, bp, bits, base);
+        uint64_t chunk = bits & mask;
         bits >>= base;
-        lz77_write_bit(lz, b64, bp, bits != 0); // stop bit
+        chunk |= (uint64_t)(bits != 0) << base; // stop bit
+        if (n + base + 1 > 64) {
+            lz77_write_bits(lz, b64, bp, chunks, n);
+            chunks = 0;
+            n = 0;
+        }
+        chunks |= chunk << n;
+        n += base + 1;
     } while (bits != 0);
+    lz77_write_bits(lz, b64, bp, chunks, n);
+}
+
+// Exact number of bits lz77_write_*() emit, used to price parsing choices:
+
+static inline uint32_t lz77_number_bits(uint64_t bits, uint8_t base) {
+    uint32_t chunks = 1;
+    bits >>= base;
+    while (bits != 0) { chunks++; bits >>= base; }
+    return chunks * (base + 1); // each chunk is followed by a stop bit
+}
+
+static inline uint32_t lz77_bit_length(uint64_t v) { // v > 0
+    uint32_t n = 1;
+    while ((v >> n) != 0) { n++; }
+    return n;
+}
+
+static inline uint32_t lz77_literal_bits(uint8_t b) {
+    return b < 0x80 ? 1 + 7 : 2 + 7;
+}
+
+static inline uint32_t lz77_match_bits(size_t pos, size_t len, uint8_t base) {
+    return 2 + lz77_number_bits(pos, base) + lz77_number_bits(len, base);
+}
+
+static inline void lz77_write_literal(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint8_t b) {
+    lz77_stats_literal(lz, b, lz77_literal_bits(b));
+    // European texts are predominantly spaces and small ASCII letters:
+    if (b < 0x80) { // flag `0` and 7 bits of ASCII byte
+        lz77_write_bits(lz, b64, bp, (uint64_t)b << 1, 1 + 7);
+    } else { // flags `1` then `0` and only 7 bits because 8th bit is `1`
+        lz77_write_bits(lz, b64, bp, 0b01 | ((uint64_t)(b & 0x7F) << 2), 2 + 7);
+    }
+}
+
+static inline void lz77_write_match(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, size_t pos, size_t len, uint8_t base) {
+    lz77_stats_match(lz, pos, len, lz77_match_bits(pos, len, base));
+    lz77_write_bits(lz, b64, bp, 0b11, 2); /* flags */
+    lz77_write_number(lz, b64, bp, pos, base);
+    lz77_write_number(lz, b64, bp, len, base);
 }
 
 #pragma push_macro("write_bit")
 #pragma push_macro("write_bits")
 #pragma push_macro("write_number")
+#pragma push_macro("write_literal")
+#pragma push_macro("write_match")
 
 #pragma push_macro("read_bit")
 #pragma push_macro("read_bits")
@@ -131,6 +640,11 @@ static inline void lz77_write_number(lz77_t* lz, uint64_t* b64,
 #pragma push_macro("return_invalid")
 #pragma push_macro("lz77_if_error_return")
 
+#pragma push_macro("lz77_lock")
+#pragma push_macro("lz77_unlock")
+#pragma push_macro("lz77_wait")
+#pragma push_macro("lz77_signal")
+
 #define lz77_if_error_return(lz);do {                   \
     if (lz->error) { return; }                          \
 } while (0)
@@ -156,185 +670,3833 @@ static inline void lz77_write_number(lz77_t* lz, uint64_t* b64,
     lz77_if_error_return(lz);                           \
 } while (0)
 
+// parsers write tokens as bits or collect them in e->token[]
+// for blocks to choose their coding
+
+#define write_literal(lz, b) do {                       \
+    if (e->token != null) {                             \
+        e->token[e->count].pos = 0;                     \
+        e->token[e->count++].len = (b);                 \
+    } else {                                            \
+        lz77_write_literal(lz, &b64, &bp, b);           \
+        lz77_if_error_return(lz);                       \
+    }                                                   \
+} while (0)
+
+#define write_match(lz, distance, length, base) do {    \
+    const uint64_t code =                               \
+        lz77_rep_take(e->rep, distance);                \
+    if (e->token != null) {                             \
+        e->token[e->count].pos = (uint32_t)code;        \
+        e->token[e->count++].len = (uint32_t)(length);  \
+    } else {                                            \
+        lz77_write_match(lz, &b64, &bp,                 \
+                         code, length, base);           \
+        lz77_if_error_return(lz);                       \
+    }                                                   \
+} while (0)
+
+// Windows larger than 1 << lz77_near_bits are chains over the nearest
+// 1 << lz77_near_bits bytes and a sparse `far` index keyed by hash of
+// lz77_far_min bytes. Only positions picked by the same hash (one in
+// lz77_far_stride on average) are inserted and looked up: copies of
+// the same bytes pick the same positions so long repeats are found
+// at the cost of one index access per lz77_far_stride bytes. Newer
+// positions overwrite older ones with the same hash so memory is
+// bounded by lz77_far_index_bits whatever the window is. Positions are
+// kept modulo 1 << 32 and the hash is rolled byte by byte (see
+// lz77_far_slot()) so inputs of any size cost the same per byte.
+
+enum {
+    lz77_near_bits  = 20,
+    lz77_far_bits   = 30, // largest window_bits of the single format
+    lz77_far_min    = 32,
+    lz77_far_stride = 16
+};
+
+static const uint64_t lz77_far_factor = 0x9E3779B97F4A7C15ULL; // odd
+
+#ifndef lz77_far_index_bits
+#define lz77_far_index_bits 22
+#endif
+
 static void lz77_write_header(lz77_t* lz, size_t bytes, uint8_t window_bits) {
     lz77_if_error_return(lz);
-    if (window_bits < 10 || window_bits > 20) { return_invalid(lz); }
-    lz->write(lz, (uint64_t)bytes);
+    if (window_bits < 10 || window_bits > lz77_far_bits) { return_invalid(lz); }
+    lz77_write_word(lz, (uint64_t)bytes);
     lz77_if_error_return(lz);
-    lz->write(lz, (uint64_t)window_bits);
+    lz77_write_word(lz, (uint64_t)window_bits);
 }
 
-static void lz77_compress(lz77_t* lz, const uint8_t* data, size_t bytes,
-        uint8_t window_bits) {
-    lz77_if_error_return(lz);
-    if (window_bits < 10 || window_bits > 20) { return_invalid(lz); }
-    lz77_init_histograms();
-    const size_t window = ((size_t)1U) << window_bits;
-    const uint8_t base = (window_bits - 4) / 2;
-    uint64_t b64 = 0;
-    uint32_t bp = 0;
-    // for parameter verification in decompress()
-    write_bits(lz, (uint64_t)window_bits, 8);
-    size_t i = 0;
-    while (i < bytes) {
-        // length and position of longest matching sequence
-        size_t len = 0;
-        size_t pos = 0;
-        if (i >= 1) {
-            size_t j = i - 1;
-            size_t min_j = i > window ? i - window : 0;
-            while (j > min_j) {
-                rt_assert((i - j) < window);
-                const size_t n = bytes - i;
-                size_t k = 0;
-                while (k < n && data[j + k] == data[i + k]) {
-                    k++;
-                }
-                if (k > len) {
-                    len = k;
-                    pos = i - j;
-                }
-                j--;
-            }
+// Version 1 of the format codes match positions against the last
+// lz77_reps distances. Single streams carry the version in the top
+// bits of the window_bits byte they start with, streams of blocks in
+// bits 24..31 of the header. Version 0 streams still decode.
+// Since version 2 the window_bits byte of single streams is followed
+// by a byte of lz77_single_* flags. A stored message (see
+// lz77_incompressible()) has the rest of that 64-bit word zero and
+// its bytes follow as is padded with zeros to a multiple of 8.
+// With lz77_single_checksum the stream ends with a word of XXH64 of
+// the message.
+// Streams of blocks of version 2 may carry a window in block params.
+
+enum { lz77_version = 2 };
+
+enum { lz77_single_stored = 1 << 0, lz77_single_checksum = 1 << 1 };
+
+// Matches at one of the most recent distances are coded as its index
+// + 1, all others as distance + lz77_reps, so that strides of tables
+// and records cost one chunk. The used distance moves to the front.
+// Every block (and single stream) starts with lz77_rep_start[].
+
+enum { lz77_reps = 3 };
+
+static const uint32_t lz77_rep_start[lz77_reps] = { 1, 4, 8 };
+
+static inline uint32_t lz77_rep_index(const uint32_t* rep,
+        uint64_t distance) { // lz77_reps if not found
+    uint32_t k = 0;
+    while (k < lz77_reps && rep[k] != distance) { k++; }
+    return k;
+}
+
+static inline uint64_t lz77_rep_code(const uint32_t* rep,
+        uint64_t distance) {
+    const uint32_t k = lz77_rep_index(rep, distance);
+    return k < lz77_reps ? k + 1 : distance + lz77_reps;
+}
+
+static inline void lz77_rep_update(uint32_t* rep, uint32_t k,
+        uint64_t distance) {
+    if (k == lz77_reps) { k = lz77_reps - 1; } // the oldest goes
+    while (k > 0) { rep[k] = rep[k - 1]; k--; }
+    rep[0] = (uint32_t)distance;
+}
+
+// encoder: code of the match at `distance`
+static inline uint64_t lz77_rep_take(uint32_t* rep, uint64_t distance) {
+    const uint32_t k = lz77_rep_index(rep, distance);
+    lz77_rep_update(rep, k, distance);
+    return k < lz77_reps ? k + 1 : distance + lz77_reps;
+}
+
+// decoder: distance of the match coded as `code` (zero is invalid)
+static inline uint64_t lz77_rep_distance(uint32_t* rep, uint64_t code) {
+    if (code == 0) { return 0; }
+    const uint32_t k = code <= lz77_reps ? (uint32_t)code - 1 : lz77_reps;
+    const uint64_t distance = k < lz77_reps ? rep[k] : code - lz77_reps;
+    lz77_rep_update(rep, k, distance);
+    return distance;
+}
+
+// Hash chain match finder: `head` maps hash of the next lz77_min_match
+// bytes to the most recent position, `prev` links each position in the
+// window to the previous position with the same hash. Positions are
+// stored biased by `window` so zero initialized tables never produce
+// a candidate inside the window. Candidates are hints only: every one
+// of them is verified by comparing bytes. Reused tables start the next
+// input at greater `origin` instead of being cleared: entries left
+// from the previous inputs are then before position zero.
+
+enum { lz77_min_match = 3 }; // shorter matches cost more bits than literals
+
+// Match length kernels return the number of equal leading bytes of
+// a[0..n - 1] and b[0..n - 1] and never read past a + n or b + n.
+
+typedef size_t (*lz77_match_length_t)(const uint8_t* a, const uint8_t* b,
+        size_t n);
+
+static size_t lz77_match_length_bytes(const uint8_t* a, const uint8_t* b,
+        size_t n) {
+    size_t k = 0;
+    while (k < n && a[k] == b[k]) { k++; }
+    return k;
+}
+
+static inline uint64_t lz77_load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz77_ctz32(uint32_t x) { // x != 0
+    #if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (uint32_t)i;
+    #elif defined(__GNUC__)
+    return (uint32_t)__builtin_ctz(x);
+    #else
+    uint32_t n = 0;
+    while ((x & 1) == 0) { x >>= 1; n++; }
+    return n;
+    #endif
+}
+
+// index of the first different byte for nonzero a ^ b of loaded words
+static inline uint32_t lz77_first_difference(uint64_t x) {
+    #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (uint32_t)__builtin_clzll(x) >> 3;
+    #else
+    const uint32_t lo = (uint32_t)x;
+    return (lo != 0 ? lz77_ctz32(lo) : 32 + lz77_ctz32((uint32_t)(x >> 32))) >> 3;
+    #endif
+}
+
+static size_t lz77_match_length_words(const uint8_t* a, const uint8_t* b,
+        size_t n) {
+    size_t k = 0;
+    while (k + 8 <= n) {
+        const uint64_t x = lz77_load64(a + k) ^ lz77_load64(b + k);
+        if (x != 0) { return k + lz77_first_difference(x); }
+        k += 8;
+    }
+    return k + lz77_match_length_bytes(a + k, b + k, n - k);
+}
+
+#ifdef lz77_simd
+
+#ifdef _MSC_VER
+#define lz77_target_avx2
+#else
+#define lz77_target_avx2 __attribute__((target("avx2")))
+#endif
+
+static size_t lz77_match_length_sse2(const uint8_t* a, const uint8_t* b,
+        size_t n) {
+    size_t k = 0;
+    while (k + 16 <= n) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(a + k));
+        const __m128i y = _mm_loadu_si128((const __m128i*)(b + k));
+        const uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (m != 0xFFFF) { return k + lz77_ctz32(~m); }
+        k += 16;
+    }
+    return k + lz77_match_length_words(a + k, b + k, n - k);
+}
+
+lz77_target_avx2
+static size_t lz77_match_length_avx2(const uint8_t* a, const uint8_t* b,
+        size_t n) {
+    size_t k = 0;
+    while (k + 32 <= n) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(a + k));
+        const __m256i y = _mm256_loadu_si256((const __m256i*)(b + k));
+        const uint32_t m = (uint32_t)_mm256_movemask_epi8(
+                                         _mm256_cmpeq_epi8(x, y));
+        if (m != 0xFFFFFFFFU) { return k + lz77_ctz32(~m); }
+        k += 32;
+    }
+    return k + lz77_match_length_sse2(a + k, b + k, n - k);
+}
+
+static bool lz77_has_avx2(void) {
+    #ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) { return false; }
+    __cpuid(r, 1);
+    const bool osxsave = (r[2] & (1 << 27)) != 0;
+    const bool avx = (r[2] & (1 << 28)) != 0;
+    // OS saves xmm and ymm state on context switches:
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) { return false; }
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+    #else
+    return __builtin_cpu_supports("avx2");
+    #endif
+}
+
+#endif
+
+// The fastest kernel of the running CPU: SSE2 is the x86-64 baseline,
+// AVX2 is detected at runtime. Elsewhere 64-bit words are compared.
+static lz77_match_length_t lz77_match_kernel(void) {
+    #ifdef lz77_simd
+    return lz77_has_avx2() ? lz77_match_length_avx2 : lz77_match_length_sse2;
+    #else
+    return lz77_match_length_words;
+    #endif
+}
+
+typedef struct lz77_finder_s {
+    uint32_t* head;  // [1 << hash_bits]
+    uint32_t* prev;  // [window]
+    uint32_t  hash_bits;
+    uint32_t  window; // of the chains, at most 1 << lz77_near_bits
+    uint64_t  reach;  // 1 << window_bits; beyond `window` via `far`
+    uint32_t* far;    // [1 << lz77_far_index_bits] large windows only
+    uint64_t  far_hash; // rolling hash of lz77_far_min bytes at far_at
+    const uint8_t* far_at;
+    uint64_t  far_out;  // lz77_far_factor to lz77_far_min power
+    uint32_t  depth; // maximum number of chain links to follow
+    uint32_t  nice;  // stop searching when match is at least that long
+    uint32_t  origin; // added to positions of the current input
+    lz77_match_length_t match; // lz77_match_kernel()
+    const struct lz77_finder_s* base; // read only chains of a dictionary
+    #ifdef lz77_statistics
+    lz77_stats_t* stats;
+    #endif
+} lz77_finder_t;
+
+enum { lz77_greedy, lz77_lazy, lz77_optimal };
+
+static const struct {
+    uint8_t  parser;
+    uint16_t depth;
+    uint16_t nice;
+    bool     huffman; // entropy coded blocks in streams of blocks
+} lz77_levels[lz77_level_max + 1] = {
+    [1] = { lz77_greedy,     4,   16, false },
+    [2] = { lz77_greedy,    16,   32, false },
+    [3] = { lz77_greedy,    64,   64, false },
+    [4] = { lz77_lazy,      32,   64, true  },
+    [5] = { lz77_lazy,     128,  128, true  },
+    [6] = { lz77_lazy,     256,  256, true  },
+    [7] = { lz77_optimal,   64,  128, true  },
+    [8] = { lz77_optimal,  256,  256, true  },
+    [9] = { lz77_optimal, 1024, 1024, true  },
+};
+
+static inline uint32_t lz77_hash_bits(uint8_t window_bits) {
+    return window_bits < 16 ? window_bits : 16;
+}
+
+// Numbers are written in chunks of `base` bits: the same for all
+// large windows so that near distances cost as much as in 1MB one.
+static inline uint8_t lz77_base(uint8_t window_bits) {
+    return (uint8_t)(((window_bits < lz77_near_bits ?
+                       window_bits : lz77_near_bits) - 4) / 2);
+}
+
+// everything but the tables
+static void lz77_finder_setup(lz77_t* lz, lz77_finder_t* mf,
+        uint8_t window_bits, uint8_t level) {
+    const uint8_t near = window_bits < lz77_near_bits ?
+                         window_bits : lz77_near_bits;
+    mf->hash_bits = lz77_hash_bits(near);
+    mf->window = ((uint32_t)1U) << near;
+    mf->reach = ((uint64_t)1U) << window_bits;
+    mf->far_at = null;
+    mf->far_out = 1;
+    for (int i = 0; i < lz77_far_min; i++) {
+        mf->far_out *= lz77_far_factor;
+    }
+    mf->depth = lz77_levels[level].depth;
+    mf->nice = lz77_levels[level].nice;
+    mf->match = lz77_match_kernel();
+    #ifdef lz77_statistics
+    mf->stats = lz->stats;
+    #else
+    (void)lz;
+    #endif
+}
+
+static void lz77_finder_init(lz77_t* lz, lz77_finder_t* mf,
+        uint8_t window_bits, uint8_t level) {
+    lz77_finder_setup(lz, mf, window_bits, level);
+    const size_t head_bytes = sizeof(uint32_t) << mf->hash_bits;
+    const size_t prev_bytes = sizeof(uint32_t) * mf->window;
+    const size_t far_bytes = sizeof(uint32_t) << lz77_far_index_bits;
+    mf->head = (uint32_t*)lz77_alloc(head_bytes);
+    mf->prev = (uint32_t*)lz77_alloc(prev_bytes);
+    if (mf->reach > mf->window) {
+        mf->far = (uint32_t*)lz77_alloc(far_bytes);
+        if (mf->far != null) { memset(mf->far, 0x00, far_bytes); }
+    }
+    if (mf->head == null || mf->prev == null ||
+        (mf->reach > mf->window && mf->far == null)) {
+        lz->error = ENOMEM;
+    } else {
+        memset(mf->head, 0x00, head_bytes);
+    }
+}
+
+static void lz77_finder_fini(lz77_finder_t* mf) {
+    if (mf->head != null) { lz77_free(mf->head); mf->head = null; }
+    if (mf->prev != null) { lz77_free(mf->prev); mf->prev = null; }
+    if (mf->far  != null) { lz77_free(mf->far);  mf->far  = null; }
+}
+
+static inline uint32_t lz77_hash(const lz77_finder_t* mf, const uint8_t* p) {
+    const uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                       ((uint32_t)p[2] << 16);
+    return (v * 2654435761U) >> (32 - mf->hash_bits);
+}
+
+// caller guarantees that i + lz77_min_match <= bytes
+static inline void lz77_finder_insert(lz77_finder_t* mf,
+        const uint8_t* data, size_t i) {
+    const uint32_t h = lz77_hash(mf, data + i);
+    mf->prev[i & (mf->window - 1)] = mf->head[h];
+    mf->head[h] = mf->origin + (uint32_t)i + mf->window;
+}
+
+// far index slot of data[i..i + lz77_far_min - 1] or -1 if the position
+// is not picked; caller guarantees that i + lz77_far_min <= bytes.
+// Polynomial hash of the bytes is rolled from the previous position
+// (the usual case: positions are visited in order) with one multiply
+// on the dependency chain and computed afresh otherwise.
+static inline int64_t lz77_far_slot(lz77_finder_t* mf, const uint8_t* data,
+        size_t i) {
+    const uint8_t* p = data + i;
+    uint64_t h = mf->far_hash;
+    if (mf->far_at != null && p == mf->far_at + 1) {
+        h = h * lz77_far_factor +
+            (p[lz77_far_min - 1] - p[-1] * mf->far_out);
+    } else if (p != mf->far_at) {
+        h = 0;
+        for (size_t k = 0; k < lz77_far_min; k++) {
+            h = h * lz77_far_factor + p[k];
         }
-        if (len > 2) {
-            rt_assert(0 < pos && pos < window);
-            rt_assert(0 < len);
-            write_bits(lz, 0b11, 2); /* flags */
-            write_number(lz, pos, base);
-            write_number(lz, len, base);
-            lz77_histogram_pos_len(pos, len);
-            i += len;
-        } else {
-            const uint8_t b = data[i];
-            // European texts are predominantly spaces and small ASCII letters:
-            if (b < 0x80) {
-                write_bit(lz, 0); /* flags */
-                write_bits(lz, b, 7); // ASCII byte < 0x80 with 8th but set to `0`
-            } else {
-                write_bits(lz, 0b10, 2); /* flags */
-                write_bits(lz, b, 7); // only 7 bit because 8th bit is `1`
-            }
-            i++;
+    }
+    mf->far_hash = h;
+    mf->far_at = p;
+    h = (h ^ (h >> 29)) * 0xBF58476D1CE4E5B9ULL;
+    const uint64_t pick = h >> (64 - lz77_far_index_bits - 4);
+    return (pick & (lz77_far_stride - 1)) != 0 ?
+           -1 : (int64_t)(h >> (64 - lz77_far_index_bits));
+}
+
+// inserts positions [from..to - 1] skipping the tail shorter than a match
+static inline void lz77_finder_skip(lz77_finder_t* mf,
+        const uint8_t* data, size_t bytes, size_t from, size_t to) {
+    if (bytes < lz77_min_match) { return; }
+    if (mf->far != null && bytes >= lz77_far_min) {
+        const size_t end = to < bytes - lz77_far_min + 1 ?
+                           to : bytes - lz77_far_min + 1;
+        for (size_t i = from; i < end; i++) {
+            const int64_t slot = lz77_far_slot(mf, data, i);
+            if (slot >= 0) { mf->far[slot] = (uint32_t)i + 1; }
         }
     }
-    if (bp > 0) {
-        lz->write(lz, b64);
-        lz->written += 8;
+    if (to > bytes - lz77_min_match + 1) {
+        to = bytes - lz77_min_match + 1;
     }
-    lz77_dump_histograms();
+    for (size_t i = from; i < to; i++) { lz77_finder_insert(mf, data, i); }
 }
 
-static inline uint64_t lz77_read_bit(lz77_t* lz, uint64_t* b64, uint32_t* bp) {
-    if (*bp == 0) { *b64 = lz->read(lz); }
-    uint64_t bit = (*b64 >> *bp) & 1;
-    *bp = *bp == 63 ? 0 : *bp + 1;
-    return bit;
+
+// Most candidates differ within the first 8 bytes: they are compared
+// inline and only longer matches go to the kernel.
+static inline size_t lz77_match_length(const lz77_finder_t* mf,
+        const uint8_t* a, const uint8_t* b, size_t n) {
+    if (n < 8) { return lz77_match_length_bytes(a, b, n); }
+    const uint64_t x = lz77_load64(a) ^ lz77_load64(b);
+    if (x != 0) { return lz77_first_difference(x); }
+    return 8 + mf->match(a + 8, b + 8, n - 8);
 }
 
-static inline uint64_t lz77_read_bits(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint32_t n) {
-    rt_assert(n <= 64);
-    uint64_t bits = 0;
-    for (uint32_t i = 0; i < n && lz->error == 0; i++) {
-        uint64_t bit = lz77_read_bit(lz, b64, bp);
-        bits |= bit << i;
+// Walks the chain for data[i] over distances in range [1..window - 1]
+// and inserts position `i` into it. Every match longer than all the
+// previous ones is stored into len[]/pos[] (at most `max` of them).
+// Returns number of stored matches; the last one is the longest.
+// Caller guarantees that i + lz77_min_match <= bytes.
+static size_t lz77_finder_find_all(lz77_finder_t* mf, const uint8_t* data,
+        size_t bytes, size_t i, size_t* len, size_t* pos, size_t max) {
+    #ifdef lz77_statistics
+    const uint64_t start = mf->stats != null ? lz77_nanoseconds() : 0;
+    #endif
+    const size_t n = bytes - i; // maximum possible match length
+    const uint32_t w = mf->window;
+    uint32_t biased = mf->origin + (uint32_t)i + w;
+    const uint32_t h = lz77_hash(mf, data + i);
+    uint32_t candidate = mf->head[h];
+    mf->prev[i & (w - 1)] = candidate;
+    mf->head[h] = biased;
+    size_t count = 0;
+    size_t best = lz77_min_match - 1;
+    uint32_t last = 0; // distances along the chain must strictly increase
+    uint32_t depth = mf->depth;
+    const uint32_t* prev = mf->prev;
+    while (depth > 0) {
+        const uint32_t distance = biased - candidate;
+        if (distance <= last || distance >= w || distance > i) {
+            // the chain goes on into the preset dictionary if any
+            if (mf->base == null || prev == mf->base->prev) { break; }
+            prev = mf->base->prev;
+            candidate = mf->base->head[h];
+            biased = mf->base->origin + (uint32_t)i + w;
+            continue;
+        }
+        last = distance;
+        const uint8_t* s = data + i - distance;
+        // cheap rejection: candidate must extend the best match found so far
+        if (best < n && s[best] == data[i + best]) {
+            const size_t k = lz77_match_length(mf, s, data + i, n);
+            if (k > best) {
+                best = k;
+                if (count == max) { count--; } // replace last with longer
+                len[count] = k;
+                pos[count] = distance;
+                count++;
+                if (k >= mf->nice || k == n) { break; }
+            }
+        }
+        candidate = prev[(i - distance) & (w - 1)];
+        depth--;
     }
-    return bits;
+    const int64_t slot = mf->far != null && n >= lz77_far_min ?
+                         lz77_far_slot(mf, data, i) : -1;
+    if (slot >= 0) {
+        // positions modulo 1 << 32 give exact distances within reach
+        // (at most 1 << lz77_far_bits) at any input size; a stale one
+        // only makes a candidate that is compared as any other
+        const uint32_t c = mf->far[slot];
+        const size_t distance = (uint32_t)((uint32_t)i + 1 - c);
+        if (best < mf->nice && c != 0 && distance != 0 && distance <= i &&
+            distance < mf->reach) {
+            const uint8_t* s = data + i - distance;
+            const size_t k = lz77_match_length(mf, s, data + i, n);
+            if (k > best) {
+                if (count == max) { count--; } // replace last with longer
+                len[count] = k;
+                pos[count] = distance;
+                count++;
+            }
+        }
+        mf->far[slot] = (uint32_t)i + 1;
+    }
+    #ifdef lz77_statistics
+    if (mf->stats != null) {
+        mf->stats->probes += mf->depth - depth;
+        mf->stats->search_ns += lz77_nanoseconds() - start;
+    }
+    #endif
+    return count;
 }
 
-static inline uint64_t lz77_read_number(lz77_t* lz, uint64_t* b64,
-        uint32_t* bp, uint8_t base) {
-    uint64_t bits = 0;
-    uint64_t bit = 0;
-    uint32_t shift = 0;
-    do {
-        bits |= (lz77_read_bits(lz, b64, bp, base) << shift);
-        shift += base;
-        bit = lz77_read_bit(lz, b64, bp);
-    } while (bit && lz->error == 0);
-    return bits;
+// Returns length of the longest match (zero if there is none)
+// and its distance in *pos; inserts position `i` into the chains.
+static inline size_t lz77_finder_find(lz77_finder_t* mf, const uint8_t* data,
+        size_t bytes, size_t i, size_t* pos) {
+    size_t len = 0;
+    if (bytes - i >= lz77_min_match) {
+        (void)lz77_finder_find_all(mf, data, bytes, i, &len, pos, 1);
+    }
+    return len;
 }
 
-#define read_bit(lz, bit) do {                      \
-    bit = lz77_read_bit(lz, &b64, &bp);             \
-    lz77_if_error_return(lz);                       \
-} while (0)
+// Short far matches may take more bits than literals. Never emitting
+// them keeps every byte at no more than 9 bits (see compress_bound()).
+static inline bool lz77_profitable(size_t pos, size_t len, uint8_t base) {
+    return len >= lz77_min_match && lz77_match_bits(pos, len, base) <= len * 8;
+}
 
-#define read_bits(lz, bits, n) do {                 \
-    bits = lz77_read_bits(lz, &b64, &bp, n);        \
-    lz77_if_error_return(lz);                       \
-} while (0)
+typedef struct lz77_bits_s { // bit writer state
+    uint64_t b64;
+    uint32_t bp;
+} lz77_bits_t;
 
-#define read_number(lz, bits, base) do {            \
-    bits = lz77_read_number(lz, &b64, &bp, base);   \
-    lz77_if_error_return(lz);                       \
-} while (0)
+// Optimal parsing: shortest path over a segment of at least
+// `lz77_optimal_span` positions where every edge is a literal or
+// a match priced in exact bits. The segment ends at the first
+// position past the span that no edge crosses, so that matches are
+// not cut at its end (only at `lz77_optimal_tail` positions further
+// when edges keep overlapping). A match of `nice` length or longer
+// ends the segment early and is taken as is.
 
-static void lz77_read_header(lz77_t* lz, size_t *bytes, uint8_t *window_bits) {
-    lz77_if_error_return(lz);
-    *bytes = (size_t)lz->read(lz);
-    *window_bits = (uint8_t)lz->read(lz);
-    if (*window_bits < 10 || *window_bits > 20) { return_invalid(lz); }
+enum { lz77_optimal_span = 4096, lz77_optimal_tail = 4096,
+       lz77_optimal_matches = 16 };
+
+enum { lz77_optimal_most = lz77_optimal_span + lz77_optimal_tail };
+
+typedef struct lz77_optimal_s {
+    uint32_t price[lz77_optimal_most + 1]; // bits to reach position
+    uint32_t len[lz77_optimal_most + 1];   // of the edge to position
+    uint32_t pos[lz77_optimal_most + 1];   // zero for literal
+    uint32_t next[lz77_optimal_most + 1];  // forward path
+    uint32_t rep[lz77_optimal_most + 1][lz77_reps]; // at position
+} lz77_optimal_t;
+
+typedef struct lz77_token_s {
+    uint32_t pos; // zero for literal
+    uint32_t len; // or literal byte
+} lz77_token_t;
+
+typedef struct lz77_encoder_s {
+    lz77_finder_t   mf;
+    lz77_optimal_t* op;    // optimal parsing levels only
+    lz77_token_t*   token; // [block] for streams of blocks only
+    size_t          count; // of tokens
+    uint32_t        rep[lz77_reps]; // most recent match distances
+    bool            huffman;
+    uint8_t         parser;
+    uint8_t         base;
+    uint8_t         window_bits;
+    uint8_t         block_bits;
+    // compress_begin() .. compress_finish() only:
+    uint8_t*        data;   // [window + block] history followed by input
+    size_t          start;  // of the data not compressed yet
+    size_t          filled; // bytes in data[]
+    uint8_t*        out;    // [compress_bound(block)] compressed block
+    uint64_t        fold;   // of block checksums, see lz77_stream_checksum()
+} lz77_encoder_t;
+
+// Parsers encode data[from..to - 1]; data[0..from - 1] is history
+// available for back references and already inserted into the chains.
+
+static inline size_t lz77_rep_length(const lz77_finder_t* mf,
+        const uint8_t* data, size_t bytes, size_t i, size_t distance) {
+    return distance <= i && distance < mf->reach ?
+        lz77_match_length(mf, data + i - distance, data + i, bytes - i) : 0;
 }
 
-static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
-        uint8_t window_bits) {
-    lz77_if_error_return(lz);
-    uint64_t b64 = 0;
-    uint32_t bp = 0;
-    uint64_t verify_window_bits;
-    read_bits(lz, verify_window_bits, 8);
-    if (window_bits != verify_window_bits) { return_invalid(lz); }
-    if (window_bits < 10 || window_bits > 20) { return_invalid(lz); }
-    const size_t window = ((size_t)1U) << window_bits;
-    const uint8_t base = (window_bits - 4) / 2;
-    size_t i = 0; // output data[i]
-    while (i < bytes) {
-        uint64_t bit0 = 0;
-        read_bit(lz, bit0);
-        if (bit0) {
-            uint64_t bit1 = 0;
-            read_bit(lz, bit1);
-            if (bit1) {
-                uint64_t pos = 0;
-                read_number(lz, pos, base);
-                uint64_t len = 0;
-                read_number(lz, len, base);
-                rt_assert(0 < pos && pos < window);
-                if (!(0 < pos && pos < window)) { return_invalid(lz); }
-                rt_assert(0 < len);
-                if (len == 0) { return_invalid(lz); }
-                // Cannot do memcpy() here because of possible overlap.
-                // memcpy() may read more than one byte at a time.
-                uint8_t* s = data - (size_t)pos;
-                const size_t n = i + (size_t)len;
-                while (i < n) { data[i] = s[i]; i++; }
-            } else {
-                size_t b = 0; // byte >= 0x80
-                read_bits(lz, b, 7);
-                data[i] = (uint8_t)b | 0x80;
-                i++;
-            }
-        } else { // literal byte
-            size_t b = 0; // ASCII byte < 0x80
-            read_bits(lz, b, 7);
-            data[i] = (uint8_t)b;
+// bits the match saves over literals of 8 bits
+static inline int64_t lz77_gain(const lz77_encoder_t* e, size_t pos,
+        size_t len) {
+    return len < lz77_min_match ? INT64_MIN : (int64_t)len * 8 -
+        lz77_match_bits(lz77_rep_code(e->rep, pos), len, e->base);
+}
+
+// Rep matches are tried before the window search and the one of
+// `nice / 4` length is taken without it: a rep is so cheap to code
+// that the search rarely finds a longer match paying for itself.
+// Otherwise the match that saves more bits wins. Returns length of
+// the match and its distance in *pos; inserts position `i` into the
+// chains.
+static inline size_t lz77_find(lz77_encoder_t* e, const uint8_t* data,
+        size_t bytes, size_t i, size_t* pos) {
+    lz77_finder_t* mf = &e->mf;
+    size_t len = 0;
+    for (uint32_t k = 0; k < lz77_reps; k++) {
+        const size_t n = lz77_rep_length(mf, data, bytes, i, e->rep[k]);
+        if (n > len) { len = n; *pos = e->rep[k]; }
+    }
+    if (len >= mf->nice / 4) {
+        lz77_finder_skip(mf, data, bytes, i, i + 1);
+        return len;
+    }
+    size_t distance = 0;
+    const size_t n = lz77_finder_find(mf, data, bytes, i, &distance);
+    if (lz77_gain(e, distance, n) > lz77_gain(e, *pos, len)) {
+        len = n;
+        *pos = distance;
+    }
+    return len;
+}
+
+static void lz77_parse_greedy(lz77_t* lz, lz77_encoder_t* e,
+        const uint8_t* data, size_t from, size_t to, lz77_bits_t* bits) {
+    const uint8_t base = e->base;
+    lz77_finder_t* mf = &e->mf;
+    uint64_t b64 = bits->b64;
+    uint32_t bp = bits->bp;
+    size_t i = from;
+    while (i < to) {
+        // length and position of the best matching sequence
+        size_t pos = 0;
+        const size_t len = lz77_find(e, data, to, i, &pos);
+        if (lz77_profitable(lz77_rep_code(e->rep, pos), len, base)) {
+            rt_assert(0 < pos && pos < mf->reach);
+            write_match(lz, pos, len, base);
+            lz77_finder_skip(mf, data, to, i + 1, i + len);
+            i += len;
+        } else {
+            write_literal(lz, data[i]);
             i++;
         }
     }
+    bits->b64 = b64;
+    bits->bp = bp;
 }
 
-lz77_if lz77 = {
-    .write_header = lz77_write_header,
-    .compress     = lz77_compress,
-    .read_header  = lz77_read_header,
-    .decompress   = lz77_decompress,
-};
+// Lazy matching: before committing to the match found at data[i]
+// look at data[i + 1] and prefer a literal followed by the next match
+// when that encodes in fewer bits per byte.
+static void lz77_parse_lazy(lz77_t* lz, lz77_encoder_t* e,
+        const uint8_t* data, size_t from, size_t to, lz77_bits_t* bits) {
+    const uint8_t base = e->base;
+    lz77_finder_t* mf = &e->mf;
+    uint64_t b64 = bits->b64;
+    uint32_t bp = bits->bp;
+    size_t i = from;
+    while (i < to) {
+        size_t pos = 0;
+        size_t len = lz77_find(e, data, to, i, &pos);
+        if (!lz77_profitable(lz77_rep_code(e->rep, pos), len, base)) {
+            len = 0;
+        }
+        while (len >= lz77_min_match && len < mf->nice && i + 1 < to) {
+            size_t next_pos = 0;
+            size_t next_len = lz77_find(e, data, to, i + 1, &next_pos);
+            const uint64_t next_code = lz77_rep_code(e->rep, next_pos);
+            if (!lz77_profitable(next_code, next_len, base)) { next_len = 0; }
+            // bits per byte: match / len vs (literal + next) / (1 + next_len)
+            const uint64_t match =
+                lz77_match_bits(lz77_rep_code(e->rep, pos), len, base);
+            const uint64_t next = lz77_literal_bits(data[i]) +
+                lz77_match_bits(next_code, next_len, base);
+            if (next_len <= len || next * len >= match * (1 + next_len)) {
+                break;
+            }
+            write_literal(lz, data[i]);
+            i++;
+            len = next_len;
+            pos = next_pos;
+        }
+        if (len >= lz77_min_match) {
+            rt_assert(0 < pos && pos < mf->reach);
+            write_match(lz, pos, len, base);
+            // data[i + 1] may have been already inserted by look ahead
+            const size_t skip = i + 1 < to && len < mf->nice ? i + 2 : i + 1;
+            lz77_finder_skip(mf, data, to, skip, i + len);
+            i += len;
+        } else {
+            write_literal(lz, data[i]);
+            i++;
+        }
+    }
+    bits->b64 = b64;
+    bits->bp = bp;
+}
+
+static void lz77_parse_optimal(lz77_t* lz, lz77_encoder_t* e,
+        const uint8_t* data, size_t from, size_t to, lz77_bits_t* bits) {
+    const uint8_t base = e->base;
+    lz77_finder_t* mf = &e->mf;
+    lz77_optimal_t* op = e->op;
+    uint64_t b64 = bits->b64;
+    uint32_t bp = bits->bp;
+    size_t i = from;
+    while (i < to) {
+        const size_t most = to - i < lz77_optimal_most ?
+                            to - i : lz77_optimal_most;
+        op->price[0] = 0;
+        for (size_t k = 1; k <= most; k++) { op->price[k] = UINT32_MAX; }
+        size_t end = most; // of the shortest path
+        size_t far = 0;    // the farthest position edges reach
+        size_t long_len = 0;
+        size_t long_pos = 0;
+        for (size_t k = 0; k < most; k++) {
+            if (k >= lz77_optimal_span && k == far) { end = k; break; }
+            const uint32_t price = op->price[k];
+            // rep distances at `k` on the shortest path to it
+            uint32_t* rep = op->rep[k];
+            if (k == 0) {
+                memcpy(rep, e->rep, sizeof(e->rep));
+            } else {
+                memcpy(rep, op->rep[k - op->len[k]], sizeof(e->rep));
+                if (op->pos[k] != 0) {
+                    lz77_rep_update(rep, lz77_rep_index(rep, op->pos[k]),
+                                    op->pos[k]);
+                }
+            }
+            const uint32_t literal = price + lz77_literal_bits(data[i + k]);
+            if (literal < op->price[k + 1]) {
+                op->price[k + 1] = literal;
+                op->len[k + 1] = 1;
+                op->pos[k + 1] = 0;
+            }
+            if (far < k + 1) { far = k + 1; }
+            if (to - (i + k) < lz77_min_match) { continue; }
+            size_t rep_len = 0;
+            for (uint32_t r = 0; r < lz77_reps && rep_len < mf->nice; r++) {
+                const size_t n = lz77_rep_length(mf, data, to, i + k, rep[r]);
+                if (n >= mf->nice) {
+                    rep_len = n;
+                    long_pos = rep[r];
+                }
+                const size_t limit = n < most - k ? n : most - k;
+                if (limit >= lz77_min_match && far < k + limit) {
+                    far = k + limit;
+                }
+                for (size_t m = lz77_min_match; m <= limit; m++) {
+                    const uint32_t cost = price +
+                        lz77_match_bits(r + 1, m, base);
+                    if (cost < op->price[k + m]) {
+                        op->price[k + m] = cost;
+                        op->len[k + m] = (uint32_t)m;
+                        op->pos[k + m] = rep[r];
+                    }
+                }
+            }
+            if (rep_len >= mf->nice) { // taken without the search
+                lz77_finder_skip(mf, data, to, i + k, i + k + 1);
+                end = k;
+                long_len = rep_len;
+                break;
+            }
+            size_t lens[lz77_optimal_matches];
+            size_t poss[lz77_optimal_matches];
+            const size_t count = lz77_finder_find_all(mf, data, to, i + k,
+                lens, poss, lz77_optimal_matches);
+            if (count > 0 && lens[count - 1] >= mf->nice) {
+                end = k;
+                long_len = lens[count - 1];
+                long_pos = poss[count - 1];
+                break;
+            }
+            size_t m = lz77_min_match;
+            for (size_t c = 0; c < count; c++) {
+                const size_t limit = lens[c] < most - k ? lens[c] : most - k;
+                if (far < k + limit) { far = k + limit; }
+                const uint64_t code = lz77_rep_code(rep, poss[c]);
+                while (m <= limit) {
+                    const uint32_t cost = price +
+                        lz77_match_bits(code, m, base);
+                    if (cost < op->price[k + m]) {
+                        op->price[k + m] = cost;
+                        op->len[k + m] = (uint32_t)m;
+                        op->pos[k + m] = (uint32_t)poss[c];
+                    }
+                    m++;
+                }
+            }
+        }
+        // reverse the shortest path from `end` back to start of segment
+        size_t k = end;
+        while (k > 0) {
+            op->next[k - op->len[k]] = (uint32_t)k;
+            k -= op->len[k];
+        }
+        while (k < end) {
+            const size_t next = op->next[k];
+            if (op->pos[next] == 0) {
+                write_literal(lz, data[i + k]);
+            } else {
+                rt_assert(0 < op->pos[next] && op->pos[next] < mf->reach);
+                write_match(lz, op->pos[next], op->len[next], base);
+            }
+            k = next;
+        }
+        i += end;
+        if (long_len > 0) {
+            write_match(lz, long_pos, long_len, base);
+            lz77_finder_skip(mf, data, to, i + 1, i + long_len);
+            i += long_len;
+        }
+    }
+    bits->b64 = b64;
+    bits->bp = bp;
+}
+
+static void lz77_parse(lz77_t* lz, lz77_encoder_t* e, const uint8_t* data,
+        size_t from, size_t to, lz77_bits_t* bits) {
+    const uint64_t start = lz77_stats_emit_begin(lz);
+    memcpy(e->rep, lz77_rep_start, sizeof(e->rep));
+    switch (e->parser) {
+        case lz77_greedy:  lz77_parse_greedy(lz, e, data, from, to, bits);  break;
+        case lz77_lazy:    lz77_parse_lazy(lz, e, data, from, to, bits);    break;
+        default:           lz77_parse_optimal(lz, e, data, from, to, bits); break;
+    }
+    lz77_stats_emit_end(lz, start);
+}
+
+static void lz77_write_tail(lz77_t* lz, lz77_bits_t* bits) {
+    if (bits->bp > 0 && lz->error == 0) { lz77_write_word(lz, bits->b64); }
+    bits->b64 = 0;
+    bits->bp = 0;
+}
+
+static void lz77_encoder_fini(lz77_encoder_t* e) {
+    lz77_finder_fini(&e->mf);
+    if (e->op   != null) { lz77_free(e->op);   e->op   = null; }
+    if (e->data != null) { lz77_free(e->data); e->data = null; }
+    if (e->out  != null) { lz77_free(e->out);  e->out  = null; }
+    if (e->token != null) { lz77_free(e->token); e->token = null; }
+}
+
+static void lz77_encoder_setup(lz77_encoder_t* e, uint8_t window_bits,
+        uint8_t level) {
+    e->parser = lz77_levels[level].parser;
+    e->huffman = lz77_levels[level].huffman;
+    e->base = lz77_base(window_bits);
+    e->window_bits = window_bits;
+}
+
+static void lz77_encoder_init(lz77_t* lz, lz77_encoder_t* e,
+        uint8_t window_bits, uint8_t level) {
+    lz77_encoder_setup(e, window_bits, level);
+    lz77_finder_init(lz, &e->mf, window_bits, level);
+    if (lz->error == 0 && e->parser == lz77_optimal) {
+        e->op = (lz77_optimal_t*)lz77_alloc(sizeof(lz77_optimal_t));
+        if (e->op == null) { lz->error = ENOMEM; }
+    }
+    if (lz->error != 0) { lz77_encoder_fini(e); }
+}
+
+// Content checksums are XXH64 (seed 0) of the uncompressed bytes:
+// four independent 64-bit lanes over 32 byte stripes, so the hash
+// runs at several bytes per cycle and the decoder that produced the
+// bytes a moment ago finds them still in cache. Stream checksum folds
+// the 64-bit checksums of its blocks in order and so does not need
+// all the data in one place (see compress_parallel()).
+
+enum { lz77_checksum_chunk = 16 * 1024 }; // decoded and hashed at once
+
+static const uint64_t lz77_prime[5] = {
+    0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+    0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL
+};
+
+typedef struct lz77_xxh64_s {
+    uint64_t v[4];     // lanes
+    uint64_t total;    // bytes hashed
+    uint8_t  tail[32]; // of the stripe not complete yet
+    uint32_t n;        // bytes in tail[]
+} lz77_xxh64_t;
+
+static inline uint64_t lz77_rotl(uint64_t v, uint32_t r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t lz77_xxh64_round(uint64_t acc, uint64_t v) {
+    return lz77_rotl(acc + v * lz77_prime[1], 31) * lz77_prime[0];
+}
+
+static inline uint64_t lz77_xxh64_merge(uint64_t h, uint64_t v) {
+    return (h ^ lz77_xxh64_round(0, v)) * lz77_prime[0] + lz77_prime[3];
+}
+
+static inline uint64_t lz77_xxh64_avalanche(uint64_t h) {
+    h = (h ^ (h >> 33)) * lz77_prime[1];
+    h = (h ^ (h >> 29)) * lz77_prime[2];
+    return h ^ (h >> 32);
+}
+
+static void lz77_xxh64_init(lz77_xxh64_t* h) {
+    memset(h, 0x00, sizeof(*h));
+    h->v[0] = lz77_prime[0] + lz77_prime[1];
+    h->v[1] = lz77_prime[1];
+    h->v[3] = 0 - lz77_prime[0];
+}
+
+static void lz77_xxh64_stripes(lz77_xxh64_t* h, const uint8_t* p, size_t n) {
+    uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+    for (size_t i = 0; i + 32 <= n; i += 32) {
+        uint64_t w[4];
+        memcpy(w, p + i, sizeof(w));
+        v0 = lz77_xxh64_round(v0, w[0]);
+        v1 = lz77_xxh64_round(v1, w[1]);
+        v2 = lz77_xxh64_round(v2, w[2]);
+        v3 = lz77_xxh64_round(v3, w[3]);
+    }
+    h->v[0] = v0; h->v[1] = v1; h->v[2] = v2; h->v[3] = v3;
+}
+
+static void lz77_xxh64_update(lz77_xxh64_t* h, const uint8_t* p, size_t n) {
+    h->total += n;
+    if (h->n > 0) {
+        const size_t k = 32 - h->n < n ? 32 - h->n : n;
+        memcpy(h->tail + h->n, p, k);
+        h->n += (uint32_t)k;
+        p += k;
+        n -= k;
+        if (h->n < 32) { return; }
+        lz77_xxh64_stripes(h, h->tail, 32);
+        h->n = 0;
+    }
+    const size_t stripes = n & ~(size_t)31;
+    lz77_xxh64_stripes(h, p, stripes);
+    memcpy(h->tail, p + stripes, n - stripes);
+    h->n = (uint32_t)(n - stripes);
+}
+
+static uint64_t lz77_xxh64_final(const lz77_xxh64_t* h) {
+    uint64_t r = lz77_prime[4];
+    if (h->total >= 32) {
+        r = lz77_rotl(h->v[0], 1) + lz77_rotl(h->v[1], 7) +
+            lz77_rotl(h->v[2], 12) + lz77_rotl(h->v[3], 18);
+        for (int i = 0; i < 4; i++) { r = lz77_xxh64_merge(r, h->v[i]); }
+    }
+    r += h->total;
+    uint32_t i = 0;
+    for (; i + 8 <= h->n; i += 8) {
+        uint64_t w;
+        memcpy(&w, h->tail + i, sizeof(w));
+        r = lz77_rotl(r ^ lz77_xxh64_round(0, w), 27) * lz77_prime[0] +
+            lz77_prime[3];
+    }
+    if (i + 4 <= h->n) {
+        uint32_t w;
+        memcpy(&w, h->tail + i, sizeof(w));
+        r = lz77_rotl(r ^ (w * lz77_prime[0]), 23) * lz77_prime[1] +
+            lz77_prime[2];
+        i += 4;
+    }
+    for (; i < h->n; i++) {
+        r = lz77_rotl(r ^ (h->tail[i] * lz77_prime[4]), 11) * lz77_prime[0];
+    }
+    return lz77_xxh64_avalanche(r);
+}
+
+// The fold starts at lz77_prime[4] and takes lz77_xxh64_round() of
+// each 64-bit block checksum in order; its avalanche is the stream one.
+static inline uint32_t lz77_stream_checksum(uint64_t fold) {
+    return (uint32_t)lz77_xxh64_avalanche(fold);
+}
+
+// Already compressed or encrypted data is detected before parsing:
+// order-0 entropy close to 8 bits per byte and next to no repeats at
+// content defined anchors (1 in 64 positions picked by the hash of
+// their 4 bytes, so that copies of the same bytes pick the same ones).
+// Such blocks are stored as is without searching for matches and so
+// are the blocks that did not shrink.
+
+enum {
+    lz77_stored_min     = 4 * 1024,     // smaller blocks are always parsed
+    lz77_stored_entropy = 8 * 256 - 64, // 7.75 bits per byte
+    lz77_stored_reach   = 64 * 1024,    // of 1K anchors 1 in 64 bytes
+    lz77_stored_anchors = 20            // log2 of most anchors remembered
+};
+
+static uint64_t lz77_log2_q8(uint64_t x) { // 256 * log2(x) for x > 0
+    uint32_t n = 0;
+    while ((x >> n) > 1) { n++; }
+    uint64_t y = n > 30 ? x >> (n - 30) : x << (30 - n); // [1..2) Q30
+    uint64_t r = n;
+    for (int i = 0; i < 8; i++) { // next fraction bit per squaring
+        y = (y * y) >> 30;
+        r <<= 1;
+        if (y >= (((uint64_t)2) << 30)) { y >>= 1; r |= 1; }
+    }
+    return r;
+}
+
+// Byte histogram and, with non null `h`, XXH64 of the same bytes in
+// one pass: every 32 byte stripe is loaded once, counted and hashed.
+static void lz77_histogram(const uint8_t* data, size_t bytes,
+        uint32_t* count, lz77_xxh64_t* h) {
+    rt_assert(h == null || h->n == 0);
+    const size_t stripes = bytes & ~(size_t)31;
+    uint64_t v0 = 0, v1 = 0, v2 = 0, v3 = 0;
+    if (h != null) { v0 = h->v[0]; v1 = h->v[1]; v2 = h->v[2]; v3 = h->v[3]; }
+    for (size_t i = 0; i < stripes; i += 32) {
+        uint64_t w[4];
+        memcpy(w, data + i, sizeof(w));
+        if (h != null) {
+            v0 = lz77_xxh64_round(v0, w[0]);
+            v1 = lz77_xxh64_round(v1, w[1]);
+            v2 = lz77_xxh64_round(v2, w[2]);
+            v3 = lz77_xxh64_round(v3, w[3]);
+        }
+        for (int k = 0; k < 4; k++) {
+            for (int b = 0; b < 64; b += 8) { count[(uint8_t)(w[k] >> b)]++; }
+        }
+    }
+    for (size_t i = stripes; i < bytes; i++) { count[data[i]]++; }
+    if (h != null) {
+        h->v[0] = v0; h->v[1] = v1; h->v[2] = v2; h->v[3] = v3;
+        h->total += stripes;
+        lz77_xxh64_update(h, data + stripes, bytes - stripes);
+    }
+}
+
+// Order-0 entropy of the histogram in 1/256 bits per byte.
+static uint64_t lz77_entropy(const uint32_t* count, size_t bytes) {
+    uint64_t sum = 0; // of count * log2(count)
+    for (size_t i = 0; i < 256; i++) {
+        if (count[i] > 0) { sum += count[i] * lz77_log2_q8(count[i]); }
+    }
+    return (bytes * lz77_log2_q8(bytes) - sum) / bytes;
+}
+
+// Less than 1 in 64 anchors repeats one of the last 1 << `bits` anchors
+// within `window` bytes. anchor[] of 1 << `bits` zeros keeps position
+// + 1 modulo 1 << 32 like the far index (exact within reach).
+static bool lz77_few_repeats(const uint8_t* data, size_t bytes,
+        uint32_t* anchor, uint32_t bits, size_t window) {
+    rt_assert(10 <= bits && bits <= 26);
+    size_t anchors = 0;
+    size_t repeats = 0;
+    for (size_t i = 0; i + 8 <= bytes; i++) {
+        uint32_t v;
+        memcpy(&v, data + i, sizeof(v));
+        const uint32_t h = v * 2654435761U;
+        if ((h >> 26) != 0) { continue; }
+        const uint32_t k = (h >> (26 - bits)) & ((1U << bits) - 1);
+        const uint32_t distance = (uint32_t)((uint32_t)i + 1 - anchor[k]);
+        if (anchor[k] != 0 && distance != 0 && distance <= i &&
+            distance <= window &&
+            memcmp(data + i - distance, data + i, 8) == 0) {
+            repeats++;
+        }
+        anchor[k] = (uint32_t)i + 1;
+        anchors++;
+    }
+    return repeats * 64 < anchors;
+}
+
+// With non null `h` all the bytes are hashed whatever the answer.
+static bool lz77_incompressible(const uint8_t* data, size_t bytes,
+        lz77_xxh64_t* h) {
+    if (bytes < lz77_stored_min) {
+        if (h != null) { lz77_xxh64_update(h, data, bytes); }
+        return false;
+    }
+    uint32_t count[256] = {0};
+    lz77_histogram(data, bytes, count, h);
+    if (lz77_entropy(count, bytes) < lz77_stored_entropy) { return false; }
+    uint32_t anchor[1 << 10] = {0};
+    return lz77_few_repeats(data, bytes, anchor, 10, bytes);
+}
+
+static inline size_t lz77_stored_bytes(size_t bytes) {
+    return (bytes + 7) & ~(size_t)7;
+}
+
+// Bytes as is with the last word padded by zeros.
+static void lz77_write_padded(lz77_t* lz, const uint8_t* data, size_t bytes) {
+    const size_t words = bytes & ~(size_t)7;
+    lz77_write_words(lz, data, words);
+    if (words < bytes && lz->error == 0) {
+        uint64_t w = 0;
+        memcpy(&w, data + words, bytes - words);
+        lz77_write_word(lz, w);
+    }
+}
+
+// Single stream of stored message after the header; non null `h` is
+// XXH64 of the message.
+static void lz77_write_single_stored(lz77_t* lz, uint8_t window_bits,
+        const uint8_t* data, size_t bytes, const lz77_xxh64_t* h) {
+    const uint64_t flags = lz77_single_stored |
+                           (h != null ? lz77_single_checksum : 0);
+    lz77_write_word(lz, (uint64_t)window_bits | (lz77_version << 5) |
+                        (flags << 8));
+    lz77_write_padded(lz, data, bytes);
+    if (h != null && lz->error == 0) {
+        lz77_write_word(lz, lz77_xxh64_final(h));
+    }
+}
+
+// Header and stored single stream take this many bytes (and a word
+// more with lz77_single_checksum).
+static inline size_t lz77_single_stored_bytes(size_t bytes) {
+    return 3 * sizeof(uint64_t) + lz77_stored_bytes(bytes);
+}
+
+// Messages over lz77_stored_reach need every piece of that size to
+// have high entropy (most data fails on the first piece) and then
+// anchors remembered across the whole window: up to
+// 1 << lz77_stored_anchors of them, so repeats farther than 64MB back
+// in larger windows are not seen. Non null `h` hashes the message.
+static bool lz77_single_incompressible(const uint8_t* data, size_t bytes,
+        uint8_t window_bits, lz77_xxh64_t* h) {
+    if (bytes <= lz77_stored_reach) {
+        return lz77_incompressible(data, bytes, h);
+    }
+    bool high = true;
+    size_t i = 0;
+    while (i < bytes && high) {
+        const size_t n = bytes - i < lz77_stored_reach ?
+                         bytes - i : lz77_stored_reach;
+        uint32_t count[256] = {0};
+        lz77_histogram(data + i, n, count, h);
+        high = n < lz77_stored_min ||
+               lz77_entropy(count, n) >= lz77_stored_entropy;
+        i += n;
+    }
+    if (h != null) { lz77_xxh64_update(h, data + i, bytes - i); }
+    if (!high) { return false; }
+    const size_t window = ((size_t)1U) << window_bits;
+    const size_t reach = bytes < window ? bytes : window;
+    uint32_t bits = 10;
+    while (bits < lz77_stored_anchors && ((size_t)1U << (bits + 6)) < reach) {
+        bits++;
+    }
+    uint32_t* anchor = (uint32_t*)lz77_alloc(sizeof(uint32_t) << bits);
+    if (anchor == null) { return false; } // parsed and may expand
+    memset(anchor, 0x00, sizeof(uint32_t) << bits);
+    const bool few = lz77_few_repeats(data, bytes, anchor, bits, window);
+    lz77_free(anchor);
+    return few;
+}
+
+// In memory output longer than the stored message or output that did
+// not fit into `capacity` the stored message fits into is replaced.
+static bool lz77_single_fallback(const lz77_t* lz, size_t bytes) {
+    const size_t n = lz77_single_stored_bytes(bytes) +
+                     (lz->checksum ? sizeof(uint64_t) : 0);
+    return (lz->error == 0 && lz->bytes > n) ||
+           (lz->error == ENOBUFS && lz->capacity >= n);
+}
+
+static void lz77_compress_level(lz77_t* lz, const uint8_t* data,
+        size_t bytes, uint8_t window_bits, uint8_t level) {
+    lz77_if_error_return(lz);
+    if (window_bits < 10 || window_bits > lz77_far_bits) { return_invalid(lz); }
+    if (level < lz77_level_min || level > lz77_level_max) {
+        return_invalid(lz);
+    }
+    lz77_xxh64_t hash;
+    lz77_xxh64_init(&hash);
+    lz77_xxh64_t* h = lz->checksum ? &hash : null;
+    if (lz77_single_incompressible(data, bytes, window_bits, h)) {
+        lz77_write_single_stored(lz, window_bits, data, bytes, h);
+        lz77_flush(lz);
+        return;
+    }
+    lz77_encoder_t e = {0};
+    lz77_encoder_init(lz, &e, window_bits, level);
+    lz77_if_error_return(lz);
+    lz77_bits_t bits = {0};
+    // for parameter verification in decompress()
+    const uint32_t flags = h != null ? lz77_single_checksum : 0;
+    lz77_write_bits(lz, &bits.b64, &bits.bp,
+                    window_bits | (lz77_version << 5) | (flags << 8), 16);
+    if (lz->error == 0) { lz77_parse(lz, &e, data, 0, bytes, &bits); }
+    lz77_write_tail(lz, &bits);
+    if (h != null && lz->error == 0) {
+        lz77_write_word(lz, lz77_xxh64_final(h));
+    }
+    lz77_flush(lz);
+    lz77_encoder_fini(&e);
+}
+
+static void lz77_compress(lz77_t* lz, const uint8_t* data, size_t bytes,
+        uint8_t window_bits) {
+    lz77_compress_level(lz, data, bytes, window_bits, lz77_level_default);
+}
+
+// The smallest window [10..20] that reaches the nearest preceding copy
+// of all but 1/256 of the repeated 4 bytes sequences. Only positions
+// picked by the hash (one in lz77_auto_stride, the same ones in all
+// copies) are looked up and inserted into the table of last positions.
+// Inputs over lz77_auto_spans x lz77_auto_span bytes are sampled in
+// evenly spaced spans.
+
+enum { lz77_auto_hash_bits = 16, lz77_auto_stride = 16,
+       lz77_auto_span = 2 << 20, lz77_auto_spans = 4 };
+
+static uint8_t lz77_auto_window_bits(const uint8_t* data, size_t bytes) {
+    uint32_t* last = (uint32_t*)
+        lz77_alloc(sizeof(uint32_t) << lz77_auto_hash_bits);
+    if (last == null) { return lz77_near_bits; }
+    uint64_t count[lz77_near_bits + 1] = {0}; // by bit length of distance
+    const size_t span = bytes < (size_t)lz77_auto_span * lz77_auto_spans ?
+        bytes : lz77_auto_span;
+    const size_t spans = span < bytes ? lz77_auto_spans : 1;
+    for (size_t k = 0; k < spans && span >= 4; k++) {
+        const size_t from = spans == 1 ? 0 : (bytes - span) / (spans - 1) * k;
+        const uint8_t* p = data + from;
+        memset(last, 0x00, sizeof(uint32_t) << lz77_auto_hash_bits);
+        for (uint32_t i = 0; i + 4 <= span; i++) {
+            uint32_t v;
+            memcpy(&v, p + i, sizeof(v));
+            const uint32_t x = v * 2654435761U;
+            const uint32_t pick = x >> (32 - lz77_auto_hash_bits - 4);
+            if ((pick & (lz77_auto_stride - 1)) != 0) { continue; }
+            const uint32_t h = x >> (32 - lz77_auto_hash_bits);
+            const uint32_t j = last[h]; // position + 1 or zero
+            last[h] = i + 1;
+            const uint32_t distance = i + 1 - j;
+            if (j != 0 && distance < (1U << lz77_near_bits) &&
+                memcmp(p + j - 1, p + i, 4) == 0) {
+                count[lz77_bit_length(distance)]++;
+            }
+        }
+    }
+    lz77_free(last);
+    uint64_t total = 0;
+    uint64_t reached = 0;
+    uint8_t window_bits = 10;
+    for (uint32_t n = 1; n <= lz77_near_bits; n++) {
+        total += count[n];
+        if (n <= window_bits) { reached += count[n]; }
+    }
+    while (window_bits < lz77_near_bits && reached < total - total / 256) {
+        reached += count[++window_bits];
+    }
+    return window_bits;
+}
+
+// Streams of blocks. Header is two 64-bit words: uncompressed size
+// (lz77_unknown_bytes when not known up front) and
+//     window_bits | lz77_format_blocks << 8 | block_bits << 16 |
+//     lz77_version << 24
+// followed by blocks each starting with two 64-bit words:
+//     type | flags << 8 | params << 16 | uncompressed bytes << 32
+//     compressed bytes that follow (multiple of 8) | checksum << 32
+// Block of lz77_block_end type terminates the stream. Back references
+// in a block with lz77_flag_history may reach `window` bytes back into
+// preceding blocks, others can be decoded on their own. Since version
+// 2 params bits 8..12 of lz77_block_lz and lz77_block_huffman blocks
+// may hold a smaller window_bits of the block (see
+// lz77_write_tokens()) that bounds its back references.
+// Blocks with lz77_flag_checksum carry the low 32 bits of XXH64 of
+// their uncompressed bytes and the end block with it carries the
+// stream checksum in place of uncompressed bytes.
+// Optional lz77_block_index block holds offsets of all data block
+// headers from the start of the stream (one 64-bit word each)
+// and the end block compressed bytes word is the offset of the index
+// block header (zero when there is no index).
+// lz77_block_stored holds uncompressed bytes as is padded with zeros
+// to a multiple of 8.
+
+enum { lz77_format_single = 0, lz77_format_blocks = 1 };
+
+enum {
+    lz77_block_end     = 0,
+    lz77_block_lz      = 1,
+    lz77_block_index   = 2,
+    lz77_block_huffman = 3, // see lz77_write_huffman()
+    lz77_block_stored  = 4  // see lz77_incompressible()
+};
+
+enum { lz77_flag_history = 1 << 0, lz77_flag_checksum = 1 << 1 };
+
+enum { lz77_min_block_bits = 16 }; // block is max(window, 64KB)
+
+static const uint64_t lz77_unknown_bytes = UINT64_MAX;
+
+static void lz77_write_block_header(lz77_t* lz, uint8_t type, uint8_t flags,
+        uint16_t params, size_t bytes, uint64_t compressed) {
+    rt_assert(bytes <= UINT32_MAX);
+    lz77_write_word(lz, (uint64_t)type | ((uint64_t)flags << 8) |
+                        ((uint64_t)params << 16) | ((uint64_t)bytes << 32));
+    lz77_write_word(lz, compressed);
+}
+
+// End block; `index` is the offset of the index block header or zero.
+static void lz77_write_end(lz77_t* lz, uint64_t fold, uint64_t index) {
+    const uint8_t flags = lz->checksum ? lz77_flag_checksum : 0;
+    const size_t checksum = lz->checksum ? lz77_stream_checksum(fold) : 0;
+    lz77_write_block_header(lz, lz77_block_end, flags, 0, checksum, index);
+}
+
+static size_t lz77_block_bound(uint8_t block_bits) {
+    const uint64_t bits = ((uint64_t)9) << block_bits;
+    return (size_t)((bits + 63) / 64) * sizeof(uint64_t);
+}
+
+// Output buffers for e->block_bits blocks.
+static void lz77_encoder_blocks(lz77_t* lz, lz77_encoder_t* e) {
+    lz77_if_error_return(lz);
+    const size_t block = ((size_t)1U) << e->block_bits;
+    e->out = (uint8_t*)lz77_alloc(lz77_block_bound(e->block_bits));
+    if (e->out == null) { lz->error = ENOMEM; }
+    if (lz->error == 0) {
+        e->token = (lz77_token_t*)lz77_alloc(block * sizeof(lz77_token_t));
+        if (e->token == null) { lz->error = ENOMEM; }
+    }
+}
+
+// Entropy coded blocks: literals and match lengths share one canonical
+// Huffman code and distances have another one. Lengths and distances
+// are coded as a bucket of their bit length and the bit after the
+// leading one, followed by the rest of the bits as is. Code lengths
+// of both alphabets come first: 4 bits each with zero followed by
+// 4 bits of the count of more zeros. Codes go LSB first bit reversed
+// so that the decoder looks up lz77_huffman_bits at once.
+
+enum {
+    lz77_buckets        = 63, // values [1..2^32 - 1]
+    lz77_litlen_symbols = 256 + lz77_buckets,
+    lz77_dist_symbols   = lz77_buckets,
+    lz77_huffman_bits   = 12  // longest code
+};
+
+static inline uint32_t lz77_bucket(uint64_t v, uint32_t* extra) {
+    uint32_t n = 0; // bit length of v > 0
+    while ((v >> n) > 1) { n++; }
+    n++;
+    if (n <= 2) { *extra = 0; return (uint32_t)v - 1; }
+    *extra = n - 2;
+    return 2 * n - 3 + (uint32_t)((v >> (n - 2)) & 1);
+}
+
+static inline uint64_t lz77_bucket_base(uint32_t c, uint32_t* extra) {
+    if (c < 3) { *extra = 0; return c + 1; }
+    const uint32_t n = (c + 3) >> 1;
+    *extra = n - 2;
+    return (uint64_t)(2 | ((c + 3) & 1)) << (n - 2);
+}
+
+// Code lengths for `n` symbols limited to lz77_huffman_bits.
+static void lz77_huffman_lengths(const uint32_t* freq, uint32_t n,
+        uint8_t* length) {
+    enum { nodes_max = 2 * lz77_litlen_symbols };
+    uint32_t weight[nodes_max];
+    uint16_t parent[nodes_max];
+    uint16_t depth[nodes_max];
+    bool     alive[nodes_max];
+    uint16_t symbol[lz77_litlen_symbols]; // of the leaf
+    uint32_t leaves = 0;
+    for (uint32_t s = 0; s < n; s++) {
+        length[s] = 0;
+        if (freq[s] > 0) {
+            weight[leaves] = freq[s];
+            alive[leaves] = true;
+            symbol[leaves++] = (uint16_t)s;
+        }
+    }
+    if (leaves == 1) { length[symbol[0]] = 1; }
+    if (leaves <= 1) { return; }
+    uint32_t nodes = leaves;
+    while (nodes < 2 * leaves - 1) { // merge two lightest nodes
+        uint32_t a = nodes;
+        uint32_t b = nodes;
+        for (uint32_t i = 0; i < nodes; i++) {
+            if (!alive[i]) { continue; }
+            if (a == nodes || weight[i] < weight[a]) {
+                b = a;
+                a = i;
+            } else if (b == nodes || weight[i] < weight[b]) {
+                b = i;
+            }
+        }
+        weight[nodes] = weight[a] + weight[b];
+        parent[a] = (uint16_t)nodes;
+        parent[b] = (uint16_t)nodes;
+        alive[a] = false;
+        alive[b] = false;
+        alive[nodes++] = true;
+    }
+    depth[nodes - 1] = 0;
+    for (uint32_t i = nodes - 1; i-- > 0; ) { depth[i] = depth[parent[i]] + 1; }
+    uint32_t count[lz77_huffman_bits + 1] = {0};
+    bool over = false;
+    for (uint32_t i = 0; i < leaves; i++) {
+        if (depth[i] > lz77_huffman_bits) {
+            over = true;
+            count[lz77_huffman_bits]++;
+        } else {
+            count[depth[i]]++;
+        }
+        length[symbol[i]] = (uint8_t)depth[i];
+    }
+    if (!over) { return; }
+    // Kraft sum in units of 2^-lz77_huffman_bits must not exceed one:
+    // replace one longest code and a shorter one by two codes one bit
+    // longer than the shorter one until it fits.
+    uint32_t total = 0;
+    for (uint32_t l = 1; l <= lz77_huffman_bits; l++) {
+        total += count[l] << (lz77_huffman_bits - l);
+    }
+    while (total > (1U << lz77_huffman_bits)) {
+        count[lz77_huffman_bits]--;
+        for (uint32_t l = lz77_huffman_bits - 1; l > 0; l--) {
+            if (count[l] > 0) {
+                count[l]--;
+                count[l + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+    // shorter codes to more frequent symbols
+    for (uint32_t i = 1; i < leaves; i++) {
+        const uint16_t leaf = symbol[i];
+        const uint32_t w = weight[i];
+        uint32_t j = i;
+        while (j > 0 && weight[j - 1] < w) {
+            weight[j] = weight[j - 1];
+            symbol[j] = symbol[j - 1];
+            j--;
+        }
+        weight[j] = w;
+        symbol[j] = leaf;
+    }
+    uint32_t l = 1;
+    for (uint32_t i = 0; i < leaves; i++) {
+        while (count[l] == 0) { l++; }
+        count[l]--;
+        length[symbol[i]] = (uint8_t)l;
+    }
+}
+
+// Canonical codes bit reversed for LSB first output. Returns false
+// if the lengths oversubscribe the code space.
+static bool lz77_huffman_codes(const uint8_t* length, uint32_t n,
+        uint16_t* code) {
+    uint32_t count[lz77_huffman_bits + 1] = {0};
+    for (uint32_t s = 0; s < n; s++) { count[length[s]]++; }
+    count[0] = 0;
+    uint32_t next[lz77_huffman_bits + 1];
+    uint32_t c = 0;
+    uint32_t total = 0;
+    for (uint32_t l = 1; l <= lz77_huffman_bits; l++) {
+        c = (c + count[l - 1]) << 1;
+        next[l] = c;
+        total += count[l] << (lz77_huffman_bits - l);
+    }
+    if (total > (1U << lz77_huffman_bits)) { return false; }
+    for (uint32_t s = 0; s < n; s++) {
+        const uint32_t l = length[s];
+        if (l == 0) { continue; }
+        const uint32_t v = next[l]++;
+        uint32_t r = 0;
+        for (uint32_t k = 0; k < l; k++) { r |= ((v >> k) & 1) << (l - 1 - k); }
+        code[s] = (uint16_t)r;
+    }
+    return true;
+}
+
+// Bits of lengths as written by lz77_write_lengths().
+static uint64_t lz77_lengths_bits(const uint8_t* length, uint32_t n) {
+    uint64_t bits = 0;
+    uint32_t s = 0;
+    while (s < n) {
+        uint32_t run = 1;
+        if (length[s] == 0) {
+            while (s + run < n && length[s + run] == 0 && run < 16) { run++; }
+            bits += 4;
+        }
+        bits += 4;
+        s += run;
+    }
+    return bits;
+}
+
+static void lz77_write_lengths(lz77_t* lz, lz77_bits_t* bits,
+        const uint8_t* length, uint32_t n) {
+    uint32_t s = 0;
+    while (s < n && lz->error == 0) {
+        if (length[s] != 0) {
+            lz77_write_bits(lz, &bits->b64, &bits->bp, length[s], 4);
+            s++;
+        } else {
+            uint32_t run = 1;
+            while (s + run < n && length[s + run] == 0 && run < 16) { run++; }
+            lz77_write_bits(lz, &bits->b64, &bits->bp, (run - 1) << 4, 8);
+            s += run;
+        }
+    }
+}
+
+typedef struct lz77_code_s {
+    uint8_t  length[lz77_litlen_symbols + lz77_dist_symbols];
+    uint16_t code[lz77_litlen_symbols + lz77_dist_symbols];
+} lz77_code_t;
+
+// Returns bits of the entropy coded tokens or UINT64_MAX when
+// the tokens do not fit the code.
+static uint64_t lz77_huffman_build(const lz77_token_t* token, size_t count,
+        lz77_code_t* hc) {
+    uint32_t freq[lz77_litlen_symbols + lz77_dist_symbols] = {0};
+    uint32_t* dist = freq + lz77_litlen_symbols;
+    uint64_t bits = 0; // extra bits
+    for (size_t i = 0; i < count; i++) {
+        if (token[i].pos == 0) {
+            freq[token[i].len]++;
+        } else {
+            uint32_t extra = 0;
+            freq[256 + lz77_bucket(token[i].len, &extra)]++;
+            bits += extra;
+            dist[lz77_bucket(token[i].pos, &extra)]++;
+            bits += extra;
+        }
+    }
+    lz77_huffman_lengths(freq, lz77_litlen_symbols, hc->length);
+    lz77_huffman_lengths(dist, lz77_dist_symbols,
+                         hc->length + lz77_litlen_symbols);
+    if (!lz77_huffman_codes(hc->length, lz77_litlen_symbols, hc->code) ||
+        !lz77_huffman_codes(hc->length + lz77_litlen_symbols,
+                            lz77_dist_symbols,
+                            hc->code + lz77_litlen_symbols)) {
+        return UINT64_MAX;
+    }
+    bits += lz77_lengths_bits(hc->length, lz77_litlen_symbols + lz77_dist_symbols);
+    for (uint32_t s = 0; s < lz77_litlen_symbols + lz77_dist_symbols; s++) {
+        bits += (uint64_t)freq[s] * hc->length[s];
+    }
+    return bits;
+}
+
+static void lz77_write_huffman(lz77_t* lz, const lz77_token_t* token,
+        size_t count, const lz77_code_t* hc) {
+    lz77_bits_t bits = {0};
+    // both alphabets lengths are written as one sequence
+    lz77_write_lengths(lz, &bits, hc->length,
+                       lz77_litlen_symbols + lz77_dist_symbols);
+    const uint8_t*  dl = hc->length + lz77_litlen_symbols;
+    const uint16_t* dc = hc->code + lz77_litlen_symbols;
+    for (size_t i = 0; i < count && lz->error == 0; i++) {
+        const uint32_t len = token[i].len;
+        if (token[i].pos == 0) {
+            lz77_stats_literal(lz, len, hc->length[len]);
+            lz77_write_bits(lz, &bits.b64, &bits.bp, hc->code[len],
+                            hc->length[len]);
+        } else {
+            uint32_t extra = 0;
+            uint32_t c = 256 + lz77_bucket(len, &extra);
+            uint64_t v = len & ((((uint64_t)1) << extra) - 1);
+            const uint32_t n = hc->length[c] + extra;
+            lz77_write_bits(lz, &bits.b64, &bits.bp,
+                hc->code[c] | (v << hc->length[c]), n);
+            const uint32_t pos = token[i].pos;
+            c = lz77_bucket(pos, &extra);
+            v = pos & ((((uint64_t)1) << extra) - 1);
+            lz77_write_bits(lz, &bits.b64, &bits.bp,
+                dc[c] | (v << dl[c]), dl[c] + extra);
+            lz77_stats_match(lz, pos, len, n + dl[c] + extra);
+        }
+    }
+    lz77_write_tail(lz, &bits);
+}
+
+// Blocks of lz77_block_lz type choose bases of positions and lengths
+// that write their tokens in the fewest bits (parsers price matches
+// with lz77_base() so the choice only makes the block shorter) and
+// record them as params pos_base | len_base << 4. Zero params stand
+// for lz77_base(window_bits) of both. Blocks of lz77_block_lz and
+// lz77_block_huffman types whose longest distance fits a smaller
+// window [10..window_bits - 1] record it as params window_bits << 8.
+// The finder still searches the whole stream window: picking the
+// block window before the parse takes a sampling pass over history
+// and block that costs up to 40% of level 1 compression time.
+
+enum { lz77_base_min = 1, lz77_base_max = 15 };
+
+// count[n] numbers of bit length n; returns the base and *bits
+static uint8_t lz77_best_base(const uint32_t* count, uint64_t* bits) {
+    uint8_t best = lz77_base_min;
+    *bits = UINT64_MAX;
+    for (uint32_t b = lz77_base_min; b <= lz77_base_max; b++) {
+        uint64_t sum = 0;
+        for (uint32_t n = 1; n <= 64; n++) {
+            sum += (uint64_t)count[n] * ((n + b - 1) / b) * (b + 1);
+        }
+        if (sum < *bits) { *bits = sum; best = (uint8_t)b; }
+    }
+    return best;
+}
+
+// Tokens are entropy coded when it saves bits.
+static uint8_t lz77_write_tokens(lz77_t* lz, lz77_encoder_t* e,
+        uint16_t* params) {
+    uint32_t pos_count[65] = {0};
+    uint32_t len_count[65] = {0};
+    uint64_t raw = 0;
+    uint32_t top = 0; // longest distance + lz77_reps
+    for (size_t i = 0; i < e->count; i++) {
+        if (e->token[i].pos == 0) {
+            raw += lz77_literal_bits((uint8_t)e->token[i].len);
+        } else {
+            raw += 2;
+            if (e->token[i].pos > top) { top = e->token[i].pos; }
+            pos_count[lz77_bit_length(e->token[i].pos)]++;
+            len_count[lz77_bit_length(e->token[i].len)]++;
+        }
+    }
+    uint64_t pos_bits = 0;
+    uint64_t len_bits = 0;
+    const uint8_t pos_base = lz77_best_base(pos_count, &pos_bits);
+    const uint8_t len_base = lz77_best_base(len_count, &len_bits);
+    raw += pos_bits + len_bits;
+    // reps are distances of the block or lz77_rep_start[] all < 1KB
+    const uint32_t distance = top > lz77_reps ? top - lz77_reps : 0;
+    uint8_t window_bits = 10;
+    while ((((uint32_t)1U) << window_bits) <= distance) { window_bits++; }
+    *params = window_bits < e->window_bits ?
+              (uint16_t)(window_bits << 8) : 0;
+    lz77_code_t hc;
+    if (e->huffman && lz77_huffman_build(e->token, e->count, &hc) < raw) {
+        lz77_write_huffman(lz, e->token, e->count, &hc);
+        return lz77_block_huffman;
+    }
+    *params = (uint16_t)(*params | pos_base | (len_base << 4));
+    lz77_bits_t bits = {0};
+    for (size_t i = 0; i < e->count && lz->error == 0; i++) {
+        const lz77_token_t* t = &e->token[i];
+        if (t->pos == 0) {
+            lz77_write_literal(lz, &bits.b64, &bits.bp, (uint8_t)t->len);
+        } else {
+            lz77_stats_match(lz, t->pos, t->len, 2 +
+                lz77_number_bits(t->pos, pos_base) +
+                lz77_number_bits(t->len, len_base));
+            lz77_write_bits(lz, &bits.b64, &bits.bp, 0b11, 2);
+            lz77_write_number(lz, &bits.b64, &bits.bp, t->pos, pos_base);
+            lz77_write_number(lz, &bits.b64, &bits.bp, t->len, len_base);
+        }
+    }
+    lz77_write_tail(lz, &bits);
+    return lz77_block_lz;
+}
+
+// Parses data[from..to - 1] into e->out; returns compressed bytes,
+// block *type and its *params.
+static size_t lz77_encode_block(lz77_t* lz, lz77_encoder_t* e,
+        const uint8_t* data, size_t from, size_t to, uint8_t* type,
+        uint16_t* params) {
+    lz77_t out = {
+        .buffer = e->out,
+        .capacity = lz77_block_bound(e->block_bits),
+        .stats = lz->stats
+    };
+    lz77_bits_t bits = {0};
+    e->count = 0;
+    lz77_parse(&out, e, data, from, to, &bits);
+    const uint64_t start = lz77_stats_emit_begin(&out);
+    *type = lz77_write_tokens(&out, e, params);
+    lz77_stats_emit_end(&out, start);
+    if (out.error != 0) { lz->error = out.error; }
+    return out.error == 0 ? out.bytes : 0;
+}
+
+// `checksum` is zero without lz77_flag_checksum in `flags`
+static void lz77_write_block(lz77_t* lz, uint8_t type, uint8_t flags,
+        uint16_t params, size_t bytes, uint32_t checksum,
+        const uint8_t* compressed, size_t n) {
+    lz77_write_block_header(lz, type, flags, params, bytes,
+                            (uint64_t)n | ((uint64_t)checksum << 32));
+    for (size_t i = 0; i < n && lz->error == 0; i += 8) {
+        uint64_t w;
+        memcpy(&w, compressed + i, sizeof(w));
+        lz77_write_word(lz, w);
+    }
+}
+
+static void lz77_write_stored(lz77_t* lz, uint8_t flags, uint32_t checksum,
+        const uint8_t* data, size_t bytes) {
+    lz77_write_block_header(lz, lz77_block_stored, flags, 0, bytes,
+        (uint64_t)lz77_stored_bytes(bytes) | ((uint64_t)checksum << 32));
+    lz77_write_padded(lz, data, bytes);
+}
+
+static void lz77_compress_block(lz77_t* lz, lz77_encoder_t* e,
+        size_t from, size_t to) {
+    uint8_t flags = from > 0 ? lz77_flag_history : 0;
+    uint32_t checksum = 0;
+    lz77_xxh64_t hash;
+    lz77_xxh64_init(&hash);
+    const bool stored = lz77_incompressible(e->data + from, to - from,
+                                            lz->checksum ? &hash : null);
+    if (lz->checksum) {
+        const uint64_t h = lz77_xxh64_final(&hash);
+        e->fold = lz77_xxh64_round(e->fold, h);
+        checksum = (uint32_t)h;
+        flags |= lz77_flag_checksum;
+    }
+    if (stored) {
+        lz77_write_stored(lz, flags, checksum, e->data + from, to - from);
+        return;
+    }
+    uint8_t type = 0;
+    uint16_t params = 0;
+    const size_t n = lz77_encode_block(lz, e, e->data, from, to, &type,
+                                       &params);
+    if (lz->error == 0 && n >= lz77_stored_bytes(to - from)) {
+        lz77_write_stored(lz, flags, checksum, e->data + from, to - from);
+    } else if (lz->error == 0) {
+        lz77_write_block(lz, type, flags, params, to - from, checksum,
+                         e->out, n);
+    }
+}
+
+// Keeps last `window` bytes of history in front of e->data. Shift is
+// a multiple of `window` so the chain links stay where they are and
+// only the positions move.
+static void lz77_encoder_slide(lz77_encoder_t* e) {
+    lz77_finder_t* mf = &e->mf;
+    const size_t shift = e->start - mf->window;
+    rt_assert(e->start >= mf->window && shift % mf->window == 0);
+    memmove(e->data, e->data + shift, e->filled - shift);
+    e->start -= shift;
+    e->filled -= shift;
+    const uint32_t s = (uint32_t)shift;
+    const size_t n = ((size_t)1U) << mf->hash_bits;
+    for (size_t i = 0; i < n; i++) {
+        mf->head[i] = mf->head[i] >= s ? mf->head[i] - s : 0;
+    }
+    for (size_t i = 0; i < mf->window; i++) {
+        mf->prev[i] = mf->prev[i] >= s ? mf->prev[i] - s : 0;
+    }
+}
+
+static void lz77_compress_begin(lz77_t* lz, uint8_t window_bits,
+        uint8_t level) {
+    lz77_if_error_return(lz);
+    if (window_bits < 10 || window_bits > lz77_near_bits) {
+        return_invalid(lz);
+    }
+    if (level < lz77_level_min || level > lz77_level_max) {
+        return_invalid(lz);
+    }
+    if (lz->encoder != null) { return_invalid(lz); }
+    lz77_encoder_t* e = (lz77_encoder_t*)lz77_alloc(sizeof(lz77_encoder_t));
+    if (e == null) { lz->error = ENOMEM; return; }
+    memset(e, 0x00, sizeof(*e));
+    lz77_encoder_init(lz, e, window_bits, level);
+    if (lz->error == 0) {
+        e->block_bits = window_bits > lz77_min_block_bits ?
+                        window_bits : lz77_min_block_bits;
+        const size_t window = ((size_t)1U) << window_bits;
+        const size_t block  = ((size_t)1U) << e->block_bits;
+        e->data = (uint8_t*)lz77_alloc(window + block);
+        if (e->data == null) { lz->error = ENOMEM; }
+        lz77_encoder_blocks(lz, e);
+    }
+    if (lz->error != 0) {
+        lz77_encoder_fini(e);
+        lz77_free(e);
+        return;
+    }
+    lz->encoder = e;
+    e->fold = lz77_prime[4];
+    lz77_write_word(lz, lz77_unknown_bytes);
+    lz77_write_word(lz, (uint64_t)window_bits |
+                        ((uint64_t)lz77_format_blocks << 8) |
+                        ((uint64_t)e->block_bits << 16) |
+                        ((uint64_t)lz77_version << 24));
+}
+
+static void lz77_compress_update(lz77_t* lz, const uint8_t* data,
+        size_t bytes) {
+    lz77_if_error_return(lz);
+    lz77_encoder_t* e = lz->encoder;
+    if (e == null) { return_invalid(lz); }
+    const size_t block = ((size_t)1U) << e->block_bits;
+    const size_t capacity = e->mf.window + block;
+    while (bytes > 0 && lz->error == 0) {
+        if (e->start + block > capacity) { lz77_encoder_slide(e); }
+        const size_t room = e->start + block - e->filled;
+        const size_t n = bytes < room ? bytes : room;
+        memcpy(e->data + e->filled, data, n);
+        e->filled += n;
+        data += n;
+        bytes -= n;
+        if (e->filled - e->start == block) {
+            lz77_compress_block(lz, e, e->start, e->filled);
+            e->start = e->filled;
+        }
+    }
+}
+
+static void lz77_compress_finish(lz77_t* lz) {
+    lz77_encoder_t* e = lz->encoder;
+    if (e == null) { lz77_if_error_return(lz); return_invalid(lz); }
+    if (lz->error == 0 && e->filled > e->start) {
+        lz77_compress_block(lz, e, e->start, e->filled);
+    }
+    if (lz->error == 0) {
+        lz77_write_end(lz, e->fold, 0);
+        lz77_flush(lz);
+    }
+    lz77_encoder_fini(e);
+    lz77_free(e);
+    lz->encoder = null;
+}
+
+// Threads for compress_parallel(), decompress_parallel() and
+// compress_batch(): workers share the state behind a lock and run on
+// the calling thread too.
+
+typedef struct lz77_sync_s {
+    #ifndef lz77_no_threads
+    mtx_t lock;
+    cnd_t turn;
+    #else
+    uint8_t none;
+    #endif
+} lz77_sync_t;
+
+#ifndef lz77_no_threads
+#define lz77_lock(s)   mtx_lock(&(s)->lock)
+#define lz77_unlock(s) mtx_unlock(&(s)->lock)
+#define lz77_wait(s)   cnd_wait(&(s)->turn, &(s)->lock)
+#define lz77_signal(s) cnd_broadcast(&(s)->turn)
+#else
+#define lz77_lock(s)   do { (void)(s); } while (0)
+#define lz77_unlock(s) do { (void)(s); } while (0)
+#define lz77_wait(s)   do { (void)(s); } while (0)
+#define lz77_signal(s) do { (void)(s); } while (0)
+#endif
+
+static errno_t lz77_sync_init(lz77_sync_t* s) {
+    #ifndef lz77_no_threads
+    if (mtx_init(&s->lock, mtx_plain) != thrd_success) { return ENOMEM; }
+    if (cnd_init(&s->turn) != thrd_success) {
+        mtx_destroy(&s->lock);
+        return ENOMEM;
+    }
+    #else
+    (void)s;
+    #endif
+    return 0;
+}
+
+static void lz77_sync_fini(lz77_sync_t* s) {
+    #ifndef lz77_no_threads
+    cnd_destroy(&s->turn);
+    mtx_destroy(&s->lock);
+    #else
+    (void)s;
+    #endif
+}
+
+// Runs worker(that) on the calling thread and up to `threads - 1` others.
+static void lz77_run(int (*worker)(void*), void* that, uint32_t threads) {
+    #ifndef lz77_no_threads
+    enum { lz77_max_threads = 256 };
+    thrd_t thread[lz77_max_threads];
+    if (threads > lz77_max_threads) { threads = lz77_max_threads; }
+    uint32_t started = 0;
+    while (started + 1 < threads &&
+           thrd_create(&thread[started], worker, that) == thrd_success) {
+        started++;
+    }
+    worker(that);
+    for (uint32_t i = 0; i < started; i++) { thrd_join(thread[i], null); }
+    #else
+    (void)threads;
+    worker(that);
+    #endif
+}
+
+// Pipelined I/O: `buffer` is a ring of slots. The codec fills (or
+// drains) slot `head` while the I/O thread writes (or fills) slots
+// from `tail` on. ready[i] is a slot handed to the other side.
+
+enum { lz77_pipe_slots = 3 };
+
+typedef struct lz77_pipe_s {
+    lz77_t      io;       // copy of the caller's lz77_t for the callbacks
+    lz77_sync_t sync;
+    #ifndef lz77_no_threads
+    thrd_t      thread;
+    #endif
+    uint8_t*    buffer;   // caller's `buffer` and `capacity`
+    size_t      capacity;
+    size_t      slot;     // bytes per slot, whole words
+    uint32_t    slots;
+    uint32_t    head;     // codec
+    uint32_t    tail;     // I/O thread
+    size_t      bytes[lz77_pipe_slots];
+    bool        ready[lz77_pipe_slots];
+    bool        reading;
+    bool        holding;  // codec drains slot `head`
+    bool        done;     // reader reached the end of data
+    bool        stop;
+    errno_t     error;    // of the callbacks
+} lz77_pipe_t;
+
+#ifndef lz77_no_threads
+
+static void lz77_pipe_writer(lz77_pipe_t* p) {
+    lz77_lock(&p->sync);
+    for (;;) {
+        while (!p->ready[p->tail] && !p->stop) { lz77_wait(&p->sync); }
+        if (!p->ready[p->tail]) { break; } // stopped with nothing queued
+        const uint32_t i = p->tail;
+        lz77_unlock(&p->sync);
+        if (p->io.error == 0) {
+            p->io.write_block(&p->io, p->buffer + i * p->slot, p->bytes[i]);
+        }
+        lz77_lock(&p->sync);
+        if (p->error == 0) { p->error = p->io.error; }
+        p->ready[i] = false;
+        p->tail = (i + 1) % p->slots;
+        lz77_signal(&p->sync);
+    }
+    lz77_unlock(&p->sync);
+}
+
+static void lz77_pipe_reader(lz77_pipe_t* p) {
+    lz77_lock(&p->sync);
+    while (!p->done) {
+        while (p->ready[p->tail] && !p->stop) { lz77_wait(&p->sync); }
+        if (p->stop) { break; }
+        const uint32_t i = p->tail;
+        lz77_unlock(&p->sync);
+        uint8_t* data = p->buffer + i * p->slot;
+        size_t n = 0;
+        bool end = false;
+        while (n < p->slot && p->io.error == 0 && !end) {
+            const size_t k = p->io.read_block(&p->io, data + n, p->slot - n);
+            end = k == 0;
+            n += k;
+        }
+        lz77_lock(&p->sync);
+        if (p->error == 0) { p->error = p->io.error; }
+        p->bytes[i] = n;
+        p->ready[i] = true;
+        p->tail = (i + 1) % p->slots;
+        p->done = end || p->error != 0;
+        lz77_signal(&p->sync);
+    }
+    p->done = true;
+    lz77_signal(&p->sync);
+    lz77_unlock(&p->sync);
+}
+
+static int lz77_pipe_thread(void* that) {
+    lz77_pipe_t* p = (lz77_pipe_t*)that;
+    if (p->reading) { lz77_pipe_reader(p); } else { lz77_pipe_writer(p); }
+    return 0;
+}
+
+#endif
+
+static void lz77_pipe_write(lz77_t* lz) {
+    lz77_pipe_t* p = lz->pipe;
+    lz77_lock(&p->sync);
+    p->bytes[p->head] = lz->bytes;
+    p->ready[p->head] = true;
+    lz77_signal(&p->sync);
+    p->head = (p->head + 1) % p->slots;
+    while (p->ready[p->head] && p->error == 0) { lz77_wait(&p->sync); }
+    if (lz->error == 0) { lz->error = p->error; }
+    lz77_unlock(&p->sync);
+    lz->buffer = p->buffer + p->head * p->slot;
+}
+
+static void lz77_pipe_read(lz77_t* lz) {
+    lz77_pipe_t* p = lz->pipe;
+    lz77_lock(&p->sync);
+    if (p->holding) { // give drained slot back to the reader
+        p->ready[p->head] = false;
+        p->head = (p->head + 1) % p->slots;
+        lz77_signal(&p->sync);
+    }
+    while (!p->ready[p->head] && !p->done) { lz77_wait(&p->sync); }
+    p->holding = p->ready[p->head];
+    if (lz->error == 0) { lz->error = p->error; }
+    lz->buffer = p->buffer + p->head * p->slot;
+    lz->bytes = p->holding ? p->bytes[p->head] : 0;
+    lz->position = 0;
+    lz77_unlock(&p->sync);
+}
+
+static void lz77_pipe_begin(lz77_t* lz, uint32_t buffers) {
+    lz77_if_error_return(lz);
+    const bool reading = lz->read_block != null;
+    if (lz->pipe != null || reading == (lz->write_block != null) ||
+        buffers < 2 || buffers > lz77_pipe_slots || lz->buffer == null ||
+        lz->capacity / buffers < sizeof(uint64_t) || lz->bytes != 0) {
+        return_invalid(lz);
+    }
+    #ifndef lz77_no_threads
+    lz77_pipe_t* p = (lz77_pipe_t*)lz77_alloc(sizeof(lz77_pipe_t));
+    if (p == null) { lz->error = ENOMEM; return; }
+    memset(p, 0x00, sizeof(*p));
+    p->io = *lz;
+    p->io.stats = null; // not thread safe
+    p->buffer = lz->buffer;
+    p->capacity = lz->capacity;
+    p->slot = lz->capacity / buffers / sizeof(uint64_t) * sizeof(uint64_t);
+    p->slots = buffers;
+    p->reading = reading;
+    lz->error = lz77_sync_init(&p->sync);
+    if (lz->error == 0 &&
+        thrd_create(&p->thread, lz77_pipe_thread, p) != thrd_success) {
+        lz77_sync_fini(&p->sync);
+        lz->error = ENOMEM;
+    }
+    if (lz->error != 0) { lz77_free(p); return; }
+    lz->pipe = p;
+    lz->capacity = p->slot;
+    lz->position = 0;
+    #endif
+}
+
+static void lz77_pipe_end(lz77_t* lz) {
+    lz77_pipe_t* p = lz->pipe;
+    if (p == null) { return; }
+    #ifndef lz77_no_threads
+    if (!p->reading) { lz77_flush(lz); }
+    lz77_lock(&p->sync);
+    p->stop = true;
+    lz77_signal(&p->sync);
+    lz77_unlock(&p->sync);
+    thrd_join(p->thread, null);
+    if (lz->error == 0) { lz->error = p->error; }
+    lz->buffer = p->buffer;
+    lz->capacity = p->capacity;
+    lz->bytes = 0;
+    lz->position = 0;
+    lz77_sync_fini(&p->sync);
+    lz77_free(p);
+    lz->pipe = null;
+    #endif
+}
+
+// Block parallel compression: every block is parsed by its own
+// encoder that starts from empty hash chains (primed with up to
+// `window` preceding bytes when `history` is true) so output does
+// not depend on number of threads. Workers take blocks in order and
+// write them to `lz` in the same order under the lock.
+
+typedef struct lz77_parallel_s {
+    lz77_t*        lz;
+    const uint8_t* data;
+    size_t         bytes;
+    uint8_t        window_bits;
+    uint8_t        level;
+    uint8_t        block_bits;
+    bool           history;
+    size_t         blocks;
+    size_t         next;    // block to compress
+    size_t         written; // blocks written to lz
+    uint64_t       start;   // lz->written at the start of the stream
+    uint64_t*      index;   // [blocks] offsets of the block headers
+    uint64_t       fold;    // of block checksums written so far
+    lz77_sync_t    sync;    // `turn` is signaled after each written block
+} lz77_parallel_t;
+
+static void lz77_finder_reset(lz77_finder_t* mf) {
+    memset(mf->head, 0x00, sizeof(uint32_t) << mf->hash_bits);
+}
+
+static int lz77_parallel_worker(void* that) {
+    lz77_parallel_t* p = (lz77_parallel_t*)that;
+    const size_t window = ((size_t)1U) << p->window_bits;
+    const size_t block = ((size_t)1U) << p->block_bits;
+    lz77_t status = {0}; // of this worker
+    #ifdef lz77_statistics
+    lz77_stats_t stats = {0}; // merged into p->lz->stats at the end
+    if (p->lz->stats != null) { status.stats = &stats; }
+    #endif
+    lz77_encoder_t e = {0};
+    lz77_encoder_init(&status, &e, p->window_bits, p->level);
+    if (status.error == 0) {
+        e.block_bits = p->block_bits;
+        lz77_encoder_blocks(&status, &e);
+    }
+    lz77_lock(&p->sync);
+    while (p->lz->error == 0 && status.error == 0 && p->next < p->blocks) {
+        const size_t k = p->next++;
+        lz77_unlock(&p->sync);
+        const size_t from = k * block;
+        const size_t n = p->bytes - from < block ? p->bytes - from : block;
+        const size_t history = !p->history ? 0 : from < window ? from : window;
+        const uint8_t* data = p->data + from - history;
+        lz77_xxh64_t hash;
+        lz77_xxh64_init(&hash);
+        bool stored = lz77_incompressible(data + history, n,
+                                          p->lz->checksum ? &hash : null);
+        const uint64_t h = p->lz->checksum ? lz77_xxh64_final(&hash) : 0;
+        size_t bytes = 0;
+        uint8_t type = 0;
+        uint16_t params = 0;
+        if (!stored) {
+            lz77_finder_reset(&e.mf);
+            lz77_finder_skip(&e.mf, data, history + n, 0, history);
+            bytes = lz77_encode_block(&status, &e, data, history,
+                                      history + n, &type, &params);
+            stored = bytes >= lz77_stored_bytes(n);
+        }
+        lz77_lock(&p->sync);
+        while (p->written != k && p->lz->error == 0) { lz77_wait(&p->sync); }
+        if (p->lz->error == 0 && status.error == 0) {
+            uint8_t flags = history > 0 ? lz77_flag_history : 0;
+            if (p->lz->checksum) {
+                flags |= lz77_flag_checksum;
+                p->fold = lz77_xxh64_round(p->fold, h);
+            }
+            p->index[k] = p->lz->written - p->start;
+            if (stored) {
+                lz77_write_stored(p->lz, flags, (uint32_t)h, data + history,
+                                  n);
+            } else {
+                lz77_write_block(p->lz, type, flags, params, n, (uint32_t)h,
+                                 e.out, bytes);
+            }
+        }
+        p->written++;
+        lz77_signal(&p->sync);
+    }
+    if (p->lz->error == 0) { p->lz->error = status.error; }
+    #ifdef lz77_statistics
+    if (p->lz->stats != null) { lz77_stats_merge(p->lz->stats, &stats); }
+    #endif
+    lz77_signal(&p->sync);
+    lz77_unlock(&p->sync);
+    lz77_encoder_fini(&e);
+    return 0;
+}
+
+static void lz77_compress_parallel(lz77_t* lz, const uint8_t* data,
+        size_t bytes, uint8_t window_bits, uint8_t level, uint8_t block_bits,
+        bool history, uint32_t threads) {
+    lz77_if_error_return(lz);
+    if (window_bits == lz77_window_auto) {
+        window_bits = lz77_auto_window_bits(data, bytes);
+        if (window_bits > block_bits) { window_bits = block_bits; }
+    }
+    if (window_bits < 10 || window_bits > lz77_near_bits) {
+        return_invalid(lz);
+    }
+    if (level < lz77_level_min || level > lz77_level_max) {
+        return_invalid(lz);
+    }
+    if (block_bits < lz77_min_block_bits || block_bits < window_bits ||
+        block_bits > 30) {
+        return_invalid(lz);
+    }
+    lz77_parallel_t p = {
+        .lz = lz, .data = data, .bytes = bytes,
+        .window_bits = window_bits, .level = level, .block_bits = block_bits,
+        .history = history,
+        .blocks = (bytes + (((size_t)1U) << block_bits) - 1) >> block_bits,
+        .start = lz->written, .fold = lz77_prime[4]
+    };
+    lz->error = lz77_sync_init(&p.sync);
+    lz77_if_error_return(lz);
+    p.index = (uint64_t*)lz77_alloc(p.blocks * sizeof(uint64_t) + 1);
+    if (p.index == null) { lz->error = ENOMEM; }
+    lz77_write_word(lz, (uint64_t)bytes);
+    lz77_write_word(lz, (uint64_t)window_bits |
+                        ((uint64_t)lz77_format_blocks << 8) |
+                        ((uint64_t)block_bits << 16) |
+                        ((uint64_t)lz77_version << 24));
+    if (lz->error == 0) {
+        lz77_run(lz77_parallel_worker, &p,
+                 threads < p.blocks ? threads : (uint32_t)p.blocks);
+    }
+    if (lz->error == 0) {
+        const uint64_t index = lz->written - p.start;
+        lz77_write_block_header(lz, lz77_block_index, 0, 0, 0,
+                                p.blocks * sizeof(uint64_t));
+        for (size_t i = 0; i < p.blocks && lz->error == 0; i++) {
+            lz77_write_word(lz, p.index[i]);
+        }
+        lz77_write_end(lz, p.fold, index);
+        lz77_flush(lz);
+    }
+    if (p.index != null) { lz77_free(p.index); }
+    lz77_sync_fini(&p.sync);
+}
+
+// *b64 holds *bp (<= 64) not yet consumed bits LSB first. A word
+// is read only when more bits are needed than buffered so reading
+// never goes past the end of the stream.
+
+static inline uint64_t lz77_read_bits(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint32_t n) {
+    rt_assert(n <= 64 && *bp <= 64);
+    uint64_t bits = 0;
+    if (n <= *bp) {
+        bits = *b64;
+        *b64 = n < 64 ? *b64 >> n : 0;
+        *bp -= n;
+    } else {
+        const uint64_t w = lz77_read_word(lz);
+        const uint32_t need = n - *bp; // [1..64] bits from `w`
+        bits = *b64 | (w << *bp);      // *bp < n <= 64
+        *b64 = need < 64 ? w >> need : 0;
+        *bp = 64 - need;
+    }
+    return n < 64 ? bits & ((((uint64_t)1) << n) - 1) : bits;
+}
+
+static inline uint64_t lz77_read_bit(lz77_t* lz, uint64_t* b64, uint32_t* bp) {
+    return lz77_read_bits(lz, b64, bp, 1);
+}
+
+static inline uint64_t lz77_read_number(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp, uint8_t base) {
+    const uint64_t mask = (((uint64_t)1) << base) - 1;
+    uint64_t bits = 0;
+    uint64_t chunk = 0;
+    uint32_t shift = 0;
+    do {
+        if (shift >= 64) { lz->error = EINVAL; break; }
+        chunk = lz77_read_bits(lz, b64, bp, base + 1); // with stop bit
+        bits |= (chunk & mask) << shift;
+        shift += base;
+    } while ((chunk >> base) != 0 && lz->error == 0);
+    return bits;
+}
+
+// Flags and literal prefix decoded with a single lookup of 9 bits:
+// `0` + 7 bits, `10` + 7 bits (byte | 0x80) or `11` for a match.
+// Low byte of an entry is literal and high byte is number of bits
+// the prefix takes (8 or 9) or lz77_prefix_match (2) for a match.
+
+enum { lz77_prefix_match = 2 };
+
+#define lz77_prefix(v) ((uint16_t)(((v) & 1) == 0 ?                    \
+    (8 << 8) | (((v) >> 1) & 0x7F) : ((v) & 2) == 0 ?                  \
+    (9 << 8) | 0x80 | (((v) >> 2) & 0x7F) : lz77_prefix_match << 8))
+#define lz77_prefix4(v)   lz77_prefix(v), lz77_prefix((v) + 1),       \
+                          lz77_prefix((v) + 2), lz77_prefix((v) + 3)
+#define lz77_prefix16(v)  lz77_prefix4(v), lz77_prefix4((v) + 4),     \
+                          lz77_prefix4((v) + 8), lz77_prefix4((v) + 12)
+#define lz77_prefix64(v)  lz77_prefix16(v), lz77_prefix16((v) + 16),  \
+                          lz77_prefix16((v) + 32), lz77_prefix16((v) + 48)
+#define lz77_prefix256(v) lz77_prefix64(v), lz77_prefix64((v) + 64),  \
+                          lz77_prefix64((v) + 128), lz77_prefix64((v) + 192)
+
+static const uint16_t lz77_prefixes[512] = {
+    lz77_prefix256(0), lz77_prefix256(256)
+};
+
+#undef lz77_prefix256
+#undef lz77_prefix64
+#undef lz77_prefix16
+#undef lz77_prefix4
+#undef lz77_prefix
+
+static inline uint16_t lz77_read_prefix(lz77_t* lz, uint64_t* b64,
+        uint32_t* bp) {
+    uint16_t e = 0;
+    if (*bp >= 9) {
+        e = lz77_prefixes[*b64 & 0x1FF];
+        *b64 >>= e >> 8;
+        *bp -= e >> 8;
+    } else if (lz77_read_bit(lz, b64, bp) == 0) {
+        e = (uint16_t)(lz77_read_bits(lz, b64, bp, 7) | (8 << 8));
+    } else if (lz77_read_bit(lz, b64, bp) == 0) {
+        e = (uint16_t)(lz77_read_bits(lz, b64, bp, 7) | 0x80 | (9 << 8));
+    } else {
+        e = lz77_prefix_match << 8;
+    }
+    return e;
+}
+
+static inline void lz77_copy8(uint8_t* d, const uint8_t* s) {
+    uint64_t w;
+    memcpy(&w, s, sizeof(w));
+    memcpy(d, &w, sizeof(w));
+}
+
+// Copies match of `len` bytes at distance `pos` to `d` where back
+// references may overlap the bytes being written. Up to 7 bytes past
+// `d + len` (but never past `end`) may be written with garbage that
+// the following tokens overwrite.
+static inline void lz77_copy_match(uint8_t* d, size_t pos, size_t len,
+        const uint8_t* end) {
+    const uint8_t* s = d - pos;
+    if (pos == 1) {
+        memset(d, *s, len);
+        return;
+    }
+    if (pos < 8) {
+        // replicate the pattern byte by byte until the data repeats
+        // at distance that is a multiple of `pos` and at least 8
+        const size_t step = pos * ((8 + pos - 1) / pos);
+        const size_t n = len < step ? len : step;
+        for (size_t k = 0; k < n; k++) { d[k] = s[k]; }
+        d += n;
+        len -= n;
+        s = d - step;
+    }
+    uint8_t* e = d + len;
+    while (d + 16 <= e) {
+        lz77_copy8(d, s);
+        lz77_copy8(d + 8, s + 8);
+        d += 16;
+        s += 16;
+    }
+    if (e + 8 <= end) { // wild copy: it is safe to write past `e`
+        while (d < e) { lz77_copy8(d, s); d += 8; s += 8; }
+    } else {
+        while (d < e) { *d++ = *s++; }
+    }
+}
+
+#define read_bit(lz, bit) do {                      \
+    bit = lz77_read_bit(lz, &b64, &bp);             \
+    lz77_if_error_return(lz);                       \
+} while (0)
+
+#define read_bits(lz, bits, n) do {                 \
+    bits = lz77_read_bits(lz, &b64, &bp, n);        \
+    lz77_if_error_return(lz);                       \
+} while (0)
+
+#define read_number(lz, bits, base) do {            \
+    bits = lz77_read_number(lz, &b64, &bp, base);   \
+    lz77_if_error_return(lz);                       \
+} while (0)
+
+static void lz77_read_header(lz77_t* lz, size_t *bytes, uint8_t *window_bits) {
+    lz77_if_error_return(lz);
+    *bytes = (size_t)lz77_read_word(lz);
+    const uint64_t w = lz77_read_word(lz); // streams of blocks have more bits
+    *window_bits = (uint8_t)w;
+    if (w < 10 || w > lz77_far_bits) { return_invalid(lz); }
+}
+
+typedef struct lz77_decoder_s {
+    lz77_bits_t bits;
+    uint64_t    left; // bytes to decode in the block or single stream
+    size_t      pos;  // distance of the match cut short by `to`
+    size_t      len;  // bytes of that match still to copy
+    uint8_t     window_bits;
+    uint8_t     reach_bits; // window of the block, at most window_bits
+    uint8_t     pos_base;   // of numbers in lz77_block_lz and single stream
+    uint8_t     len_base;
+    uint8_t     version;    // of the stream, see lz77_version
+    uint32_t    rep[lz77_reps];
+    // decompress_begin() .. decompress_finish() only:
+    uint8_t     format;
+    uint8_t     block_bits;
+    bool        end;        // of stream reached
+    uint8_t*    data;       // [window + chunk] history followed by output
+    size_t      capacity;
+    size_t      filled;     // bytes in data[]
+    size_t      delivered;  // bytes of data[] given to the caller
+    uint64_t    consumed;   // lz->consumed at the start of the block
+    uint64_t    compressed; // bytes of the block
+    uint8_t     type;       // of the block
+    uint8_t     flags;      // of the block
+    uint32_t    checksum;   // of the block with lz77_flag_checksum
+    lz77_xxh64_t hash;       // of the block bytes decoded so far
+    uint64_t    fold;       // of block checksums, see lz77_stream_checksum()
+    // lz77_block_huffman and lz77_block_stored (`wp` in bytes) only:
+    uint64_t    w;          // word with `wp` bits not yet moved to bits
+    uint32_t    wp;
+    uint64_t    words;      // of the block not read yet
+    uint16_t    litlen[1 << lz77_huffman_bits]; // symbol << 4 | length
+    uint16_t    dist[1 << lz77_huffman_bits];
+} lz77_decoder_t;
+
+// Decodes data[from..to - 1] with data[0..from - 1] available for back
+// references. Match copies may write garbage up to `limit`. A match
+// may run past `to` (but not past d->left): the rest of it is copied
+// by the next call.
+static lz77_force_inline void lz77_decode_base(lz77_t* lz,
+        lz77_decoder_t* d, uint8_t* data, size_t from, size_t to,
+        const uint8_t* limit, const uint8_t pos_base, const uint8_t len_base,
+        const bool reps, const uint8_t window_bits) {
+    rt_assert(to - from <= d->left);
+    rt_assert(window_bits == 0 || window_bits == d->reach_bits);
+    const size_t window = ((size_t)1U) <<
+                          (window_bits != 0 ? window_bits : d->reach_bits);
+    const uint64_t last = from + d->left; // end of the block
+    uint64_t b64 = d->bits.b64;
+    uint32_t bp = d->bits.bp;
+    size_t i = from; // output data[i]
+    if (d->len > 0 && i < to) {
+        const size_t n = d->len < to - i ? d->len : to - i;
+        lz77_copy_match(data + i, d->pos, n, limit);
+        d->len -= n;
+        i += n;
+    }
+    while (i < to) {
+        // literals do not need the reader, look them up in place:
+        while (bp >= 9 && i < to) {
+            const uint16_t e = lz77_prefixes[b64 & 0x1FF];
+            if ((e >> 8) == lz77_prefix_match) { break; }
+            b64 >>= e >> 8;
+            bp -= e >> 8;
+            lz77_stats_literal(lz, (uint8_t)e, e >> 8);
+            data[i++] = (uint8_t)e;
+        }
+        if (i == to) { break; }
+        const uint16_t e = lz77_read_prefix(lz, &b64, &bp);
+        lz77_if_error_return(lz);
+        if ((e >> 8) != lz77_prefix_match) {
+            lz77_stats_literal(lz, (uint8_t)e, e >> 8);
+            data[i++] = (uint8_t)e;
+        } else {
+            uint64_t pos = 0;
+            read_number(lz, pos, pos_base);
+            uint64_t len = 0;
+            read_number(lz, len, len_base);
+            lz77_stats_match(lz, pos, len, 2 +
+                lz77_number_bits(pos, pos_base) +
+                lz77_number_bits(len, len_base));
+            if (reps) { pos = lz77_rep_distance(d->rep, pos); }
+            rt_assert(0 < pos && pos < window && pos <= i);
+            if (!(0 < pos && pos < window && pos <= i)) { return_invalid(lz); }
+            rt_assert(0 < len && len <= last - i);
+            if (!(0 < len && len <= last - i)) { return_invalid(lz); }
+            if (len <= to - i) {
+                lz77_copy_match(data + i, (size_t)pos, (size_t)len, limit);
+                i += (size_t)len;
+            } else {
+                lz77_copy_match(data + i, (size_t)pos, to - i, limit);
+                d->pos = (size_t)pos;
+                d->len = (size_t)len - (to - i);
+                i = to;
+            }
+        }
+    }
+    d->bits.b64 = b64;
+    d->bits.bp = bp;
+    d->left -= i - from;
+}
+
+// Instances of constant bases let the compiler unroll reading of the
+// numbers and fold their masks and shifts. Window bits [10..20] (of
+// the block: reach_bits) with bases pos_base == len_base ==
+// lz77_base(reach_bits) (all single streams and blocks without params)
+// have instances of constant window as well so the range checks
+// compare to a constant. Blocks that choose other bases (mostly
+// shorter len_base) and larger windows (base 8) use instances of
+// [pos_base][len_base] in [2..8].
+// Version 0 streams (without reps) take the generic path.
+// Parsers have no such instances on purpose: tried the same way they
+// cost about 8KB of code for no measurable gain, because the match
+// search dominates their time and does not depend on window_bits.
+
+typedef void (*lz77_decode_t)(lz77_t* lz, lz77_decoder_t* d, uint8_t* data,
+        size_t from, size_t to, const uint8_t* limit);
+
+#define lz77_decode_instance(p, l)                                      \
+static void lz77_decode_##p##_##l(lz77_t* lz, lz77_decoder_t* d,       \
+        uint8_t* data, size_t from, size_t to, const uint8_t* limit) {  \
+    lz77_decode_base(lz, d, data, from, to, limit, p, l, true, 0);      \
+}
+
+#define lz77_decode_window(w)                                           \
+static void lz77_decode_w##w(lz77_t* lz, lz77_decoder_t* d,             \
+        uint8_t* data, size_t from, size_t to, const uint8_t* limit) {  \
+    lz77_decode_base(lz, d, data, from, to, limit,                      \
+                     ((w) - 4) / 2, ((w) - 4) / 2, true, w);            \
+}
+
+#define lz77_decode_instances(p)                                        \
+    lz77_decode_instance(p, 2) lz77_decode_instance(p, 3)               \
+    lz77_decode_instance(p, 4) lz77_decode_instance(p, 5)               \
+    lz77_decode_instance(p, 6) lz77_decode_instance(p, 7)               \
+    lz77_decode_instance(p, 8)
+
+#define lz77_decode_row(p) [p] = {                                      \
+    [2] = lz77_decode_##p##_2, [3] = lz77_decode_##p##_3,               \
+    [4] = lz77_decode_##p##_4, [5] = lz77_decode_##p##_5,               \
+    [6] = lz77_decode_##p##_6, [7] = lz77_decode_##p##_7,               \
+    [8] = lz77_decode_##p##_8                                           \
+}
+
+lz77_decode_instances(3)
+lz77_decode_instances(4)
+lz77_decode_instances(5)
+lz77_decode_instances(6)
+lz77_decode_instances(7)
+lz77_decode_instances(8)
+
+static const lz77_decode_t lz77_decoders[9][9] = { // [pos_base][len_base]
+    lz77_decode_row(3), lz77_decode_row(4), lz77_decode_row(5),
+    lz77_decode_row(6), lz77_decode_row(7), lz77_decode_row(8)
+};
+
+lz77_decode_window(10) lz77_decode_window(11) lz77_decode_window(12)
+lz77_decode_window(13) lz77_decode_window(14) lz77_decode_window(15)
+lz77_decode_window(16) lz77_decode_window(17) lz77_decode_window(18)
+lz77_decode_window(19) lz77_decode_window(20)
+
+static const lz77_decode_t lz77_window_decoders[lz77_near_bits + 1] = {
+    [10] = lz77_decode_w10, [11] = lz77_decode_w11, [12] = lz77_decode_w12,
+    [13] = lz77_decode_w13, [14] = lz77_decode_w14, [15] = lz77_decode_w15,
+    [16] = lz77_decode_w16, [17] = lz77_decode_w17, [18] = lz77_decode_w18,
+    [19] = lz77_decode_w19, [20] = lz77_decode_w20
+};
+
+#undef lz77_decode_row
+#undef lz77_decode_instances
+#undef lz77_decode_instance
+
+static void lz77_decode(lz77_t* lz, lz77_decoder_t* d, uint8_t* data,
+        size_t from, size_t to, const uint8_t* limit) {
+    const size_t n = sizeof(lz77_decoders) / sizeof(lz77_decoders[0]);
+    const uint8_t base = lz77_base(d->reach_bits);
+    if (d->version > 0 && d->reach_bits <= lz77_near_bits &&
+        d->pos_base == base && d->len_base == base) {
+        lz77_window_decoders[d->reach_bits](lz, d, data, from, to, limit);
+    } else if (d->pos_base < n && d->len_base < n && d->version > 0 &&
+        lz77_decoders[d->pos_base][d->len_base] != null) {
+        lz77_decoders[d->pos_base][d->len_base](lz, d, data, from, to, limit);
+    } else { // generic
+        lz77_decode_base(lz, d, data, from, to, limit,
+                         d->pos_base, d->len_base, d->version > 0, 0);
+    }
+}
+
+// Entropy coded blocks know their size in words: at least 32 bits are
+// kept in *b64 while the block has them so a code and its extra bits
+// are looked up without going back to the reader.
+static inline void lz77_huffman_refill(lz77_t* lz, lz77_decoder_t* d,
+        uint64_t* b64, uint32_t* bp) {
+    while (*bp < 32 && (d->wp > 0 || d->words > 0)) {
+        if (d->wp == 0) {
+            d->w = lz77_read_word(lz);
+            d->wp = 64;
+            d->words--;
+        }
+        const uint32_t n = 64 - *bp < d->wp ? 64 - *bp : d->wp;
+        *b64 |= d->w << *bp;
+        d->w = n < 64 ? d->w >> n : 0;
+        d->wp -= n;
+        *bp += n;
+    }
+}
+
+static inline uint64_t lz77_huffman_take(lz77_t* lz, lz77_decoder_t* d,
+        uint64_t* b64, uint32_t* bp, uint32_t n) {
+    rt_assert(n <= 32);
+    lz77_huffman_refill(lz, d, b64, bp);
+    if (n > *bp) { lz->error = EINVAL; return 0; }
+    const uint64_t v = *b64 & ((((uint64_t)1) << n) - 1);
+    *b64 >>= n;
+    *bp -= n;
+    return v;
+}
+
+static void lz77_huffman_table(lz77_t* lz, const uint8_t* length,
+        uint32_t n, uint16_t* table) {
+    uint16_t code[lz77_litlen_symbols];
+    if (!lz77_huffman_codes(length, n, code)) { return_invalid(lz); }
+    memset(table, 0x00, sizeof(uint16_t) << lz77_huffman_bits);
+    for (uint32_t s = 0; s < n; s++) {
+        const uint32_t l = length[s];
+        if (l == 0) { continue; }
+        for (uint32_t k = code[s]; k < (1U << lz77_huffman_bits); k += 1U << l) {
+            table[k] = (uint16_t)(s << 4 | l);
+        }
+    }
+}
+
+static void lz77_read_tables(lz77_t* lz, lz77_decoder_t* d) {
+    enum { n = lz77_litlen_symbols + lz77_dist_symbols };
+    uint8_t length[n];
+    uint64_t b64 = 0;
+    uint32_t bp = 0;
+    uint32_t s = 0;
+    while (s < n && lz->error == 0) {
+        const uint32_t v = (uint32_t)lz77_huffman_take(lz, d, &b64, &bp, 4);
+        if (v > lz77_huffman_bits) { return_invalid(lz); }
+        if (v != 0) {
+            length[s++] = (uint8_t)v;
+        } else {
+            const uint32_t run = 1 +
+                (uint32_t)lz77_huffman_take(lz, d, &b64, &bp, 4);
+            if (run > n - s) { return_invalid(lz); }
+            memset(length + s, 0x00, run);
+            s += run;
+        }
+    }
+    lz77_if_error_return(lz);
+    lz77_huffman_table(lz, length, lz77_litlen_symbols, d->litlen);
+    lz77_huffman_table(lz, length + lz77_litlen_symbols, lz77_dist_symbols,
+                       d->dist);
+    d->bits.b64 = b64;
+    d->bits.bp = bp;
+}
+
+// lz77_decode() for lz77_block_huffman blocks.
+static void lz77_decode_huffman(lz77_t* lz, lz77_decoder_t* d, uint8_t* data,
+        size_t from, size_t to, const uint8_t* limit) {
+    rt_assert(to - from <= d->left);
+    const size_t window = ((size_t)1U) << d->reach_bits;
+    const uint64_t last = from + d->left; // end of the block
+    const uint64_t mask = (1U << lz77_huffman_bits) - 1;
+    uint64_t b64 = d->bits.b64;
+    uint32_t bp = d->bits.bp;
+    size_t i = from; // output data[i]
+    if (d->len > 0 && i < to) {
+        const size_t n = d->len < to - i ? d->len : to - i;
+        lz77_copy_match(data + i, d->pos, n, limit);
+        d->len -= n;
+        i += n;
+    }
+    while (i < to) {
+        lz77_huffman_refill(lz, d, &b64, &bp);
+        uint16_t e = d->litlen[b64 & mask];
+        if ((e & 0xF) == 0 || (e & 0xF) > bp) { return_invalid(lz); }
+        b64 >>= e & 0xF;
+        bp -= e & 0xF;
+        if ((e >> 4) < 256) {
+            lz77_stats_literal(lz, (uint8_t)(e >> 4), e & 0xF);
+            data[i++] = (uint8_t)(e >> 4);
+            // more literals while their codes are buffered:
+            while (bp >= lz77_huffman_bits && i < to) {
+                e = d->litlen[b64 & mask];
+                if ((e >> 4) >= 256 || (e & 0xF) == 0) { break; }
+                b64 >>= e & 0xF;
+                bp -= e & 0xF;
+                lz77_stats_literal(lz, (uint8_t)(e >> 4), e & 0xF);
+                data[i++] = (uint8_t)(e >> 4);
+            }
+            continue;
+        }
+        uint32_t extra = 0;
+        uint64_t len = lz77_bucket_base((e >> 4) - 256, &extra);
+        len |= lz77_huffman_take(lz, d, &b64, &bp, extra);
+        const uint32_t n = (e & 0xF) + extra; // bits of the length
+        lz77_huffman_refill(lz, d, &b64, &bp);
+        e = d->dist[b64 & mask];
+        if ((e & 0xF) == 0 || (e & 0xF) > bp) { return_invalid(lz); }
+        b64 >>= e & 0xF;
+        bp -= e & 0xF;
+        uint64_t pos = lz77_bucket_base(e >> 4, &extra);
+        pos |= lz77_huffman_take(lz, d, &b64, &bp, extra);
+        lz77_if_error_return(lz);
+        lz77_stats_match(lz, pos, len, n + (e & 0xF) + extra);
+        if (d->version > 0) { pos = lz77_rep_distance(d->rep, pos); }
+        rt_assert(0 < pos && pos < window && pos <= i);
+        if (!(0 < pos && pos < window && pos <= i)) { return_invalid(lz); }
+        rt_assert(0 < len && len <= last - i);
+        if (!(0 < len && len <= last - i)) { return_invalid(lz); }
+        if (len <= to - i) {
+            lz77_copy_match(data + i, (size_t)pos, (size_t)len, limit);
+            i += (size_t)len;
+        } else {
+            lz77_copy_match(data + i, (size_t)pos, to - i, limit);
+            d->pos = (size_t)pos;
+            d->len = (size_t)len - (to - i);
+            i = to;
+        }
+    }
+    d->bits.b64 = b64;
+    d->bits.bp = bp;
+    d->left -= i - from;
+}
+
+// Block header `w` and `compressed` bytes are read and block follows.
+static void lz77_block_begin(lz77_t* lz, lz77_decoder_t* d, uint64_t w,
+        uint64_t compressed) {
+    const uint16_t params = (uint16_t)(w >> 16);
+    d->type = (uint8_t)w;
+    d->flags = (uint8_t)(w >> 8);
+    d->left = w >> 32;
+    d->checksum = (uint32_t)(compressed >> 32);
+    compressed = (uint32_t)compressed;
+    memcpy(d->rep, lz77_rep_start, sizeof(d->rep));
+    const uint8_t bases = (uint8_t)params;
+    const uint8_t reach = (uint8_t)(params >> 8);
+    d->pos_base = bases == 0 ? lz77_base(d->window_bits) : bases & 0xF;
+    d->len_base = bases == 0 ? lz77_base(d->window_bits) : bases >> 4;
+    d->reach_bits = reach == 0 ? d->window_bits : reach;
+    d->len = 0;
+    d->w = 0;
+    d->wp = 0;
+    d->words = compressed / sizeof(uint64_t);
+    d->consumed = lz->consumed;
+    d->compressed = compressed;
+    memset(&d->bits, 0x00, sizeof(d->bits));
+    if (d->type != lz77_block_lz && d->type != lz77_block_huffman &&
+        d->type != lz77_block_stored) {
+        return_invalid(lz);
+    }
+    if (compressed % sizeof(uint64_t) != 0) { return_invalid(lz); }
+    if (d->flags & lz77_flag_checksum) {
+        lz77_xxh64_init(&d->hash);
+    } else if (d->checksum != 0) {
+        return_invalid(lz);
+    }
+    if (bases != 0 && (d->type != lz77_block_lz ||
+        d->pos_base < lz77_base_min || d->len_base < lz77_base_min)) {
+        return_invalid(lz);
+    }
+    if (reach != 0 && (d->type == lz77_block_stored ||
+        reach < 10 || reach >= d->window_bits)) {
+        return_invalid(lz);
+    }
+    if (d->type == lz77_block_stored &&
+        compressed != lz77_stored_bytes((size_t)d->left)) {
+        return_invalid(lz);
+    }
+    if (d->type == lz77_block_huffman) { lz77_read_tables(lz, d); }
+}
+
+// Stored block bytes are copied from words and the last word may be
+// split between calls.
+static void lz77_decode_stored(lz77_t* lz, lz77_decoder_t* d, uint8_t* data,
+        size_t from, size_t to) {
+    size_t i = from;
+    while (i < to && d->wp > 0) {
+        data[i++] = (uint8_t)d->w;
+        d->w >>= 8;
+        d->wp--;
+    }
+    const size_t n = (to - i) & ~(size_t)7;
+    lz77_read_words(lz, data + i, n);
+    i += n;
+    if (i < to && lz->error == 0) {
+        d->w = lz77_read_word(lz);
+        d->wp = sizeof(d->w);
+        while (i < to) {
+            data[i++] = (uint8_t)d->w;
+            d->w >>= 8;
+            d->wp--;
+        }
+    }
+    d->left -= to - from;
+}
+
+static void lz77_decode_chunk(lz77_t* lz, lz77_decoder_t* d, uint8_t* data,
+        size_t from, size_t to, const uint8_t* limit) {
+    if (d->type == lz77_block_huffman) {
+        lz77_decode_huffman(lz, d, data, from, to, limit);
+    } else if (d->type == lz77_block_stored) {
+        lz77_decode_stored(lz, d, data, from, to);
+    } else {
+        lz77_decode(lz, d, data, from, to, limit);
+    }
+}
+
+// Blocks with checksum are decoded in lz77_checksum_chunk pieces each
+// hashed right after it is written while it is still in L1 cache.
+static void lz77_decode_block(lz77_t* lz, lz77_decoder_t* d, uint8_t* data,
+        size_t from, size_t to, const uint8_t* limit) {
+    if ((d->flags & lz77_flag_checksum) == 0) {
+        lz77_decode_chunk(lz, d, data, from, to, limit);
+        return;
+    }
+    while (from < to && lz->error == 0) {
+        const size_t n = to - from < lz77_checksum_chunk ?
+                         to - from : lz77_checksum_chunk;
+        lz77_decode_chunk(lz, d, data, from, from + n, limit);
+        lz77_xxh64_update(&d->hash, data + from, n);
+        from += n;
+    }
+}
+
+// After the last byte of the block is decoded.
+static void lz77_block_finish(lz77_t* lz, lz77_decoder_t* d) {
+    while (d->type == lz77_block_huffman && d->words > 0 &&
+           lz->error == 0) { // padding
+        (void)lz77_read_word(lz);
+        d->words--;
+    }
+    if (lz->error == 0 && lz->consumed - d->consumed != d->compressed) {
+        return_invalid(lz);
+    }
+    if (lz->error == 0 && (d->flags & lz77_flag_checksum)) {
+        const uint64_t h = lz77_xxh64_final(&d->hash);
+        if ((uint32_t)h != d->checksum) { lz->error = EBADMSG; return; }
+        d->fold = lz77_xxh64_round(d->fold, h);
+    }
+}
+
+// End block word `w` of the stream decoded block by block from its start.
+static void lz77_stream_end(lz77_t* lz, lz77_decoder_t* d, uint64_t w) {
+    if ((uint32_t)w == (uint32_t)lz77_flag_checksum << 8) {
+        if ((w >> 32) != lz77_stream_checksum(d->fold)) {
+            lz->error = EBADMSG;
+        }
+    } else if (w != 0) {
+        return_invalid(lz);
+    }
+}
+
+// Single stream starts with window_bits | version << 5 byte and since
+// version 2 a byte of flags. Stored message is decoded as if it was
+// a lz77_block_stored block.
+static void lz77_single_begin(lz77_t* lz, lz77_decoder_t* d) {
+    const uint64_t b = lz77_read_bits(lz, &d->bits.b64, &d->bits.bp, 8);
+    lz77_if_error_return(lz);
+    if ((b & 0x1F) != d->window_bits || (b >> 5) > lz77_version) {
+        return_invalid(lz);
+    }
+    d->version = (uint8_t)(b >> 5);
+    d->reach_bits = d->window_bits;
+    d->pos_base = lz77_base(d->window_bits);
+    d->len_base = d->pos_base;
+    memcpy(d->rep, lz77_rep_start, sizeof(d->rep));
+    const uint64_t flags = d->version < 2 ? 0 :
+        lz77_read_bits(lz, &d->bits.b64, &d->bits.bp, 8);
+    lz77_if_error_return(lz);
+    const uint64_t known = lz77_single_stored | lz77_single_checksum;
+    if ((flags & ~known) != 0) { return_invalid(lz); }
+    if (flags & lz77_single_checksum) {
+        d->flags |= lz77_flag_checksum;
+        lz77_xxh64_init(&d->hash);
+    }
+    if (flags & lz77_single_stored) {
+        if (d->bits.b64 != 0) { return_invalid(lz); } // padding
+        d->type = lz77_block_stored;
+        memset(&d->bits, 0x00, sizeof(d->bits));
+    }
+}
+
+// After the last byte of the message is decoded.
+static void lz77_single_end(lz77_t* lz, lz77_decoder_t* d) {
+    if (lz->error == 0 && (d->flags & lz77_flag_checksum)) {
+        const uint64_t w = lz77_read_word(lz);
+        if (lz->error == 0 && w != lz77_xxh64_final(&d->hash)) {
+            lz->error = EBADMSG;
+        }
+    }
+}
+
+static void lz77_decompress(lz77_t* lz, uint8_t* data, size_t bytes,
+        uint8_t window_bits) {
+    lz77_if_error_return(lz);
+    if (window_bits < 10 || window_bits > lz77_far_bits) { return_invalid(lz); }
+    lz77_decoder_t d = { .left = bytes, .window_bits = window_bits };
+    lz77_single_begin(lz, &d);
+    lz77_if_error_return(lz);
+    lz77_decode_block(lz, &d, data, 0, bytes, data + bytes);
+    lz77_single_end(lz, &d);
+}
+
+// Sequential decoding does not need the index.
+static void lz77_skip_index(lz77_t* lz, uint64_t w, uint64_t compressed) {
+    if (w != lz77_block_index || compressed % sizeof(uint64_t) != 0) {
+        return_invalid(lz);
+    }
+    while (compressed > 0 && lz->error == 0) {
+        (void)lz77_read_word(lz);
+        compressed -= sizeof(uint64_t);
+    }
+}
+
+// Stream of blocks into data[0..capacity - 1]; header is already read.
+static void lz77_decompress_blocks(lz77_t* lz, uint8_t* data,
+        size_t capacity, uint8_t window_bits, uint8_t block_bits,
+        uint8_t version, size_t *decompressed) {
+    const size_t block = ((size_t)1U) << block_bits;
+    lz77_decoder_t d = { .window_bits = window_bits, .version = version,
+                         .fold = lz77_prime[4] };
+    size_t i = 0;
+    for (;;) {
+        const uint64_t w = lz77_read_word(lz);
+        const uint64_t compressed = lz77_read_word(lz);
+        lz77_if_error_return(lz);
+        const uint8_t type = (uint8_t)w;
+        const size_t bytes = (size_t)(w >> 32);
+        if (type == lz77_block_end) {
+            lz77_stream_end(lz, &d, w);
+            break;
+        }
+        if (type == lz77_block_index) {
+            lz77_skip_index(lz, w, compressed);
+            lz77_if_error_return(lz);
+            continue;
+        }
+        if (bytes > block) { return_invalid(lz); }
+        if (bytes > capacity - i) { lz->error = ENOBUFS; return; }
+        lz77_block_begin(lz, &d, w, compressed);
+        lz77_if_error_return(lz);
+        lz77_decode_block(lz, &d, data, i, i + bytes, data + capacity);
+        lz77_block_finish(lz, &d);
+        lz77_if_error_return(lz);
+        i += bytes;
+    }
+    *decompressed = i;
+}
+
+// Streaming decompression keeps `window` bytes of history in front
+// of the chunk being decoded. When the buffer is full and delivered
+// the last `window` bytes are moved to its start. Chunk is max(window,
+// 64KB) so each byte is moved at most once.
+
+static void lz77_decompress_finish(lz77_t* lz) {
+    lz77_decoder_t* d = lz->decoder;
+    if (d == null) { lz77_if_error_return(lz); return_invalid(lz); }
+    if (d->data != null) { lz77_free(d->data); }
+    lz77_free(d);
+    lz->decoder = null;
+}
+
+static lz77_decoder_t* lz77_decoder_create(lz77_t* lz, uint8_t window_bits,
+        uint8_t format, uint8_t block_bits, uint8_t version) {
+    lz77_decoder_t* d = (lz77_decoder_t*)lz77_alloc(sizeof(lz77_decoder_t));
+    if (d == null) { lz->error = ENOMEM; return null; }
+    memset(d, 0x00, sizeof(*d));
+    const size_t window = ((size_t)1U) << window_bits;
+    const size_t chunk = window > ((size_t)1U) << lz77_min_block_bits ?
+                         window : ((size_t)1U) << lz77_min_block_bits;
+    d->capacity = window + chunk;
+    d->data = (uint8_t*)lz77_alloc(d->capacity);
+    lz->decoder = d;
+    if (d->data == null) {
+        lz->error = ENOMEM;
+        lz77_decompress_finish(lz);
+        return null;
+    }
+    d->window_bits = window_bits;
+    d->version = version;
+    d->fold = lz77_prime[4];
+    d->format = format;
+    d->block_bits = block_bits;
+    return d;
+}
+
+static void lz77_decompress_begin(lz77_t* lz) {
+    lz77_if_error_return(lz);
+    if (lz->decoder != null) { return_invalid(lz); }
+    const uint64_t bytes = lz77_read_word(lz);
+    const uint64_t w = lz77_read_word(lz);
+    lz77_if_error_return(lz);
+    const uint8_t window_bits = (uint8_t)w;
+    const uint8_t format = (uint8_t)(w >> 8);
+    const uint8_t block_bits = (uint8_t)(w >> 16);
+    if (window_bits < 10 || window_bits > lz77_far_bits) { return_invalid(lz); }
+    if (format == lz77_format_single) {
+        if (w != window_bits) { return_invalid(lz); }
+    } else if (window_bits > lz77_near_bits ||
+               format != lz77_format_blocks || (w >> 24) > lz77_version ||
+               block_bits < window_bits || block_bits >= 32) {
+        return_invalid(lz);
+    }
+    lz77_decoder_t* d = lz77_decoder_create(lz, window_bits, format,
+                                            block_bits, (uint8_t)(w >> 24));
+    if (d != null && format == lz77_format_single) {
+        d->left = bytes;
+        lz77_single_begin(lz, d);
+        if (bytes == 0) { lz77_single_end(lz, d); } // nothing to fill
+    }
+}
+
+// Called when everything decoded so far is delivered.
+static void lz77_decoder_fill(lz77_t* lz, lz77_decoder_t* d) {
+    while (d->left == 0 && !d->end && lz->error == 0) {
+        if (d->format == lz77_format_single) {
+            d->end = true;
+        } else {
+            const uint64_t w = lz77_read_word(lz);
+            const uint64_t compressed = lz77_read_word(lz);
+            lz77_if_error_return(lz);
+            const uint8_t type = (uint8_t)w;
+            const uint64_t bytes = w >> 32;
+            if (type == lz77_block_end) {
+                lz77_stream_end(lz, d, w);
+                d->end = true;
+            } else if (type == lz77_block_index) {
+                lz77_skip_index(lz, w, compressed);
+            } else if (bytes > ((uint64_t)1U) << d->block_bits) {
+                return_invalid(lz);
+            } else {
+                lz77_block_begin(lz, d, w, compressed);
+            }
+        }
+    }
+    if (d->end || lz->error != 0) { return; }
+    const size_t window = ((size_t)1U) << d->window_bits;
+    if (d->filled == d->capacity) {
+        memmove(d->data, d->data + d->filled - window, window);
+        d->filled = window;
+        d->delivered = window;
+    }
+    const size_t room = d->capacity - d->filled;
+    const size_t n = d->left < room ? (size_t)d->left : room;
+    lz77_decode_block(lz, d, d->data, d->filled, d->filled + n,
+                      d->data + d->capacity);
+    lz77_if_error_return(lz);
+    d->filled += n;
+    if (d->left == 0 && d->format == lz77_format_blocks) {
+        lz77_block_finish(lz, d);
+    } else if (d->left == 0) {
+        lz77_single_end(lz, d);
+    }
+}
+
+// null `data` skips `bytes` of output (see decompress_range())
+static size_t lz77_decompress_read(lz77_t* lz, uint8_t* data, size_t bytes) {
+    lz77_decoder_t* d = lz->decoder;
+    if (lz->error != 0) { return 0; }
+    if (d == null) { lz->error = EINVAL; return 0; }
+    size_t k = 0;
+    while (k < bytes && lz->error == 0) {
+        if (d->delivered == d->filled) {
+            lz77_decoder_fill(lz, d);
+            if (d->end || lz->error != 0) { break; }
+        }
+        const size_t available = d->filled - d->delivered;
+        const size_t n = bytes - k < available ? bytes - k : available;
+        if (data != null) { memcpy(data + k, d->data + d->delivered, n); }
+        d->delivered += n;
+        k += n;
+    }
+    return lz->error == 0 ? k : 0;
+}
+
+static void lz77_decompress_stream(lz77_t* lz,
+        void (*sink)(lz77_t* lz, const uint8_t* data, size_t bytes)) {
+    lz77_if_error_return(lz);
+    lz77_decoder_t* d = lz->decoder;
+    if (d == null) { return_invalid(lz); }
+    while (lz->error == 0) {
+        if (d->delivered == d->filled) {
+            lz77_decoder_fill(lz, d);
+            if (d->end || lz->error != 0) { break; }
+        }
+        const size_t n = d->filled - d->delivered;
+        const size_t offset = d->delivered;
+        d->delivered = d->filled;
+        sink(lz, d->data + offset, n);
+    }
+}
+
+static size_t lz77_compress_bound(size_t bytes) {
+    // at most 9 bits per byte in 64-bit words plus for write_header()
+    // and window_bits byte or for stream header, index and end blocks
+    // and each of the smallest possible blocks header, padding and
+    // index entry
+    const size_t blocks = (bytes >> lz77_min_block_bits) + 1;
+    const uint64_t bits = (uint64_t)bytes * 9;
+    return 6 * sizeof(uint64_t) + blocks * 4 * sizeof(uint64_t) +
+           (size_t)((bits + 63) / 64) * sizeof(uint64_t);
+}
+
+static errno_t lz77_compress_buffer_ex(uint8_t* compressed,
+        size_t capacity, const uint8_t* data, size_t bytes,
+        uint8_t window_bits, bool checksum, size_t *written) {
+    lz77_t lz = { .buffer = compressed, .capacity = capacity,
+                  .checksum = checksum };
+    if (window_bits == lz77_window_auto) {
+        window_bits = lz77_auto_window_bits(data, bytes);
+    }
+    lz77_write_header(&lz, bytes, window_bits);
+    lz77_compress(&lz, data, bytes, window_bits);
+    if (lz77_single_fallback(&lz, bytes)) {
+        lz = (lz77_t){ .buffer = compressed, .capacity = capacity };
+        lz77_write_header(&lz, bytes, window_bits);
+        lz77_xxh64_t h;
+        lz77_xxh64_init(&h);
+        if (checksum) { lz77_xxh64_update(&h, data, bytes); }
+        lz77_write_single_stored(&lz, window_bits, data, bytes,
+                                 checksum ? &h : null);
+    }
+    *written = lz.error == 0 ? lz.bytes : 0;
+    return lz.error;
+}
+
+static errno_t lz77_compress_buffer(uint8_t* compressed, size_t capacity,
+        const uint8_t* data, size_t bytes, uint8_t window_bits,
+        size_t *written) {
+    return lz77_compress_buffer_ex(compressed, capacity, data, bytes,
+                                   window_bits, false, written);
+}
+
+static errno_t lz77_decompress_buffer(uint8_t* data, size_t capacity,
+        const uint8_t* compressed, size_t bytes, size_t *decompressed) {
+    // input is never written to when there is no read_block()
+    lz77_t lz = { .buffer = (uint8_t*)compressed, .bytes = bytes };
+    *decompressed = 0;
+    const uint64_t n = lz77_read_word(&lz);
+    const uint64_t w = lz77_read_word(&lz);
+    const uint8_t window_bits = (uint8_t)w;
+    const uint8_t format = (uint8_t)(w >> 8);
+    const uint8_t block_bits = (uint8_t)(w >> 16);
+    if (lz.error != 0) {
+        // truncated header
+    } else if (window_bits < 10 || window_bits > lz77_far_bits) {
+        lz.error = EINVAL;
+    } else if (format == lz77_format_single && w == window_bits) {
+        if (n > capacity) {
+            lz.error = ENOBUFS;
+        } else {
+            lz77_decompress(&lz, data, (size_t)n, window_bits);
+            if (lz.error == 0) { *decompressed = (size_t)n; }
+        }
+    } else if (format == lz77_format_blocks && (w >> 24) <= lz77_version &&
+               window_bits <= 20 &&
+               block_bits >= window_bits && block_bits < 32) {
+        lz77_decompress_blocks(&lz, data, capacity, window_bits, block_bits,
+                               (uint8_t)(w >> 24), decompressed);
+    } else {
+        lz.error = EINVAL;
+    }
+    return lz.error;
+}
+
+// Random access and parallel decoding of in memory streams with the
+// index. Blocks with lz77_flag_history are decoded after the preceding
+// ones starting from the nearest independent block.
+
+typedef struct lz77_index_s {
+    const uint8_t* compressed;
+    size_t         bytes;
+    uint64_t       total;   // uncompressed bytes
+    uint8_t        window_bits;
+    uint8_t        block_bits;
+    uint8_t        version;
+    size_t         blocks;
+    size_t         entries; // offset of the first index entry
+} lz77_index_t;
+
+static uint64_t lz77_word_at(const lz77_index_t* ix, uint64_t offset) {
+    uint64_t w;
+    memcpy(&w, ix->compressed + offset, sizeof(w));
+    return w;
+}
+
+// Returns offset of the k-th block header after verifying it is inside.
+static uint64_t lz77_index_offset(lz77_t* lz, const lz77_index_t* ix,
+        size_t k) {
+    const uint64_t offset = lz77_word_at(ix, ix->entries + k * 8);
+    if (offset < 16 || offset % 8 != 0 || offset > ix->bytes - 32) {
+        lz->error = EINVAL;
+        return 16;
+    }
+    return offset;
+}
+
+static uint8_t lz77_index_flags(lz77_t* lz, const lz77_index_t* ix,
+        size_t k) {
+    const uint64_t w = lz77_word_at(ix, lz77_index_offset(lz, ix, k));
+    return (uint8_t)(w >> 8);
+}
+
+static void lz77_index_read(lz77_t* lz, lz77_index_t* ix,
+        const uint8_t* compressed, size_t bytes) {
+    ix->compressed = compressed;
+    ix->bytes = bytes;
+    // header, index block header and end block at least:
+    if (bytes < 48 || bytes % 8 != 0) { return_invalid(lz); }
+    const uint64_t w = lz77_word_at(ix, 8);
+    ix->total = lz77_word_at(ix, 0);
+    ix->window_bits = (uint8_t)w;
+    ix->block_bits = (uint8_t)(w >> 16);
+    ix->version = (uint8_t)(w >> 24);
+    if ((uint8_t)(w >> 8) != lz77_format_blocks || (w >> 24) > lz77_version ||
+        ix->window_bits < 10 || ix->window_bits > lz77_near_bits ||
+        ix->block_bits < ix->window_bits || ix->block_bits >= 32) {
+        return_invalid(lz);
+    }
+    const uint32_t end = (uint32_t)lz77_word_at(ix, bytes - 16);
+    if (end != lz77_block_end && end != (uint32_t)lz77_flag_checksum << 8) {
+        return_invalid(lz);
+    }
+    const uint64_t index = lz77_word_at(ix, bytes - 8);
+    if (index == 0) { lz->error = ENOTSUP; return; } // no index
+    if (index < 16 || index % 8 != 0 || index > bytes - 32) {
+        return_invalid(lz);
+    }
+    const uint64_t n = lz77_word_at(ix, index + 8);
+    if (lz77_word_at(ix, index) != lz77_block_index || n % 8 != 0 ||
+        n != bytes - 32 - index) {
+        return_invalid(lz);
+    }
+    ix->blocks = (size_t)(n / 8);
+    ix->entries = (size_t)index + 16;
+    const uint64_t mask = (((uint64_t)1U) << ix->block_bits) - 1;
+    if ((ix->total >> ix->block_bits) + ((ix->total & mask) != 0) !=
+        ix->blocks) {
+        return_invalid(lz);
+    }
+}
+
+static errno_t lz77_decompress_range(uint8_t* data,
+        const uint8_t* compressed, size_t bytes, uint64_t from, uint64_t to) {
+    lz77_t lz = { .buffer = (uint8_t*)compressed, .bytes = bytes };
+    lz77_index_t ix = {0};
+    lz77_index_read(&lz, &ix, compressed, bytes);
+    if (lz.error != 0) { return lz.error; }
+    if (from > to || to > ix.total) { return EINVAL; }
+    if (from == to) { return 0; }
+    size_t k = (size_t)(from >> ix.block_bits); // first covering block
+    while (k > 0 && (lz77_index_flags(&lz, &ix, k) & lz77_flag_history)) {
+        k--;
+    }
+    lz.position = (size_t)lz77_index_offset(&lz, &ix, k);
+    if (lz.error == 0) {
+        lz77_decoder_create(&lz, ix.window_bits, lz77_format_blocks,
+                            ix.block_bits, ix.version);
+    }
+    if (lz.error == 0) {
+        const uint64_t skip = from - ((uint64_t)k << ix.block_bits);
+        const size_t n = (size_t)(to - from);
+        if (lz77_decompress_read(&lz, null, (size_t)skip) != skip ||
+            lz77_decompress_read(&lz, data, n) != n) {
+            if (lz.error == 0) { lz.error = EINVAL; } // truncated
+        }
+    }
+    if (lz.decoder != null) { lz77_decompress_finish(&lz); }
+    return lz.error;
+}
+
+typedef struct lz77_parallel_decoder_s {
+    lz77_index_t ix;
+    uint8_t*     data;
+    size_t       next;  // block to start decoding from
+    errno_t      error;
+    lz77_sync_t  sync;
+} lz77_parallel_decoder_t;
+
+// Decodes blocks [k..n - 1] where only the block `k` is independent.
+static void lz77_decode_run(lz77_t* lz, const lz77_index_t* ix,
+        uint8_t* data, size_t k, size_t n) {
+    const size_t block = ((size_t)1U) << ix->block_bits;
+    uint8_t* run = data + k * block;
+    const size_t end = n * block < ix->total ? n * block : (size_t)ix->total;
+    const size_t bytes = end - k * block;
+    lz->position = (size_t)lz77_index_offset(lz, ix, k);
+    lz77_decoder_t d = { .window_bits = ix->window_bits,
+                         .version = ix->version };
+    size_t i = 0;
+    while (i < bytes && lz->error == 0) {
+        const uint64_t w = lz77_read_word(lz);
+        const uint64_t compressed = lz77_read_word(lz);
+        lz77_if_error_return(lz);
+        const size_t expected = bytes - i < block ? bytes - i : block;
+        if ((w >> 32) != expected) { return_invalid(lz); }
+        lz77_block_begin(lz, &d, w, compressed);
+        lz77_if_error_return(lz);
+        lz77_decode_block(lz, &d, run, i, i + expected, run + bytes);
+        lz77_block_finish(lz, &d);
+        lz77_if_error_return(lz);
+        i += expected;
+    }
+}
+
+static int lz77_parallel_decoder(void* that) {
+    lz77_parallel_decoder_t* p = (lz77_parallel_decoder_t*)that;
+    lz77_t lz = { .buffer = (uint8_t*)p->ix.compressed, .bytes = p->ix.bytes };
+    lz77_lock(&p->sync);
+    while (p->error == 0 && p->next < p->ix.blocks) {
+        const size_t k = p->next;
+        size_t n = k + 1;
+        while (n < p->ix.blocks && lz.error == 0 &&
+               (lz77_index_flags(&lz, &p->ix, n) & lz77_flag_history)) {
+            n++;
+        }
+        p->next = n;
+        lz77_unlock(&p->sync);
+        if (lz.error == 0) { lz77_decode_run(&lz, &p->ix, p->data, k, n); }
+        lz77_lock(&p->sync);
+        if (p->error == 0) { p->error = lz.error; }
+    }
+    lz77_unlock(&p->sync);
+    return 0;
+}
+
+static errno_t lz77_decompress_parallel(uint8_t* data, size_t capacity,
+        const uint8_t* compressed, size_t bytes, uint32_t threads,
+        size_t *decompressed) {
+    *decompressed = 0;
+    lz77_t lz = { .buffer = (uint8_t*)compressed, .bytes = bytes };
+    lz77_parallel_decoder_t p = { .data = data };
+    lz77_index_read(&lz, &p.ix, compressed, bytes);
+    if (lz.error != 0) { return lz.error; }
+    if (p.ix.total > capacity) { return ENOBUFS; }
+    errno_t r = lz77_sync_init(&p.sync);
+    if (r != 0) { return r; }
+    lz77_run(lz77_parallel_decoder, &p,
+             threads < p.ix.blocks ? threads : (uint32_t)p.ix.blocks);
+    lz77_sync_fini(&p.sync);
+    if (p.error == 0) { *decompressed = (size_t)p.ix.total; }
+    return p.error;
+}
+
+// Preset dictionaries. Dictionary bytes are placed in front of the
+// message so back references reach them as ordinary history. Header
+// of the single format stream carries the dictionary id:
+//     window_bits | id << 32
+
+typedef struct lz77_dictionary_s {
+    uint8_t*      data;
+    size_t        bytes;
+    uint32_t      id;
+    uint8_t       window_bits;
+    lz77_finder_t mf; // chains of all dictionary positions
+} lz77_dictionary_t;
+
+static uint32_t lz77_dictionary_hash(const uint8_t* data, size_t bytes) {
+    uint32_t h = 2166136261U; // FNV-1a
+    for (size_t i = 0; i < bytes; i++) { h = (h ^ data[i]) * 16777619U; }
+    return h != 0 ? h : 1; // zero stands for no dictionary
+}
+
+static void lz77_dictionary_dispose(lz77_dictionary_t* d) {
+    if (d != null) {
+        lz77_finder_fini(&d->mf);
+        if (d->data != null) { lz77_free(d->data); }
+        lz77_free(d);
+    }
+}
+
+static errno_t lz77_dictionary_create(lz77_dictionary_t* *dictionary,
+        const uint8_t* data, size_t bytes, uint8_t window_bits) {
+    *dictionary = null;
+    if (window_bits < 10 || window_bits > lz77_near_bits) { return EINVAL; }
+    const size_t window = ((size_t)1U) << window_bits;
+    if (bytes > window) { // farther bytes are out of reach
+        data += bytes - window;
+        bytes = window;
+    }
+    lz77_dictionary_t* d = (lz77_dictionary_t*)lz77_alloc(sizeof(*d));
+    if (d == null) { return ENOMEM; }
+    memset(d, 0x00, sizeof(*d));
+    lz77_t status = {0};
+    d->data = (uint8_t*)lz77_alloc(bytes + 1);
+    if (d->data == null) { status.error = ENOMEM; }
+    lz77_finder_init(&status, &d->mf, window_bits, lz77_level_default);
+    if (status.error == 0) {
+        memcpy(d->data, data, bytes);
+        d->bytes = bytes;
+        d->window_bits = window_bits;
+        d->id = lz77_dictionary_hash(data, bytes);
+        lz77_finder_skip(&d->mf, d->data, bytes, 0, bytes);
+        *dictionary = d;
+    } else {
+        lz77_dictionary_dispose(d);
+    }
+    return status.error;
+}
+
+static uint32_t lz77_dictionary_id(const lz77_dictionary_t* d) {
+    return d->id;
+}
+
+// Context is a single block of memory:
+//     lz77_context_t | head | prev | lz77_optimal_t (optimal levels) |
+//     history (dictionary bytes followed by the message)
+// Decoder contexts (level zero) have only the history.
+
+typedef struct lz77_context_s {
+    lz77_encoder_t e; // its tables and parser scratch are in the block
+    bool allocated;   // by context_create()
+    uint8_t* history; // in the block, see lz77_context_prime()
+    size_t   capacity; // of history
+    const lz77_dictionary_t* primed; // bytes in front of the message
+    uint32_t primed_id;
+} lz77_context_t;
+
+static inline size_t lz77_context_header(void) {
+    return (sizeof(lz77_context_t) + 7) & ~(size_t)7;
+}
+
+static size_t lz77_context_bytes(uint8_t window_bits, uint8_t level,
+        size_t history) {
+    if (window_bits < 10 || window_bits > lz77_near_bits) { return 0; }
+    if (level > lz77_level_max) { return 0; }
+    if (history > SIZE_MAX / 2) { return 0; }
+    size_t bytes = lz77_context_header() + lz77_stored_bytes(history);
+    if (level >= lz77_level_min) {
+        bytes += (sizeof(uint32_t) << lz77_hash_bits(window_bits)) +
+                 (sizeof(uint32_t) << window_bits);
+    }
+    if (level >= lz77_level_min && lz77_levels[level].parser == lz77_optimal) {
+        bytes += sizeof(lz77_optimal_t);
+    }
+    return bytes;
+}
+
+static errno_t lz77_context_init(lz77_context_t* *context, void* memory,
+        size_t bytes, uint8_t window_bits, uint8_t level, size_t history) {
+    *context = null;
+    const size_t need = lz77_context_bytes(window_bits, level, history);
+    if (need == 0 || memory == null || (uintptr_t)memory % 8 != 0) {
+        return EINVAL;
+    }
+    if (bytes < need) { return ENOBUFS; }
+    lz77_context_t* c = (lz77_context_t*)memory;
+    memset(c, 0x00, sizeof(*c));
+    uint8_t* p = (uint8_t*)memory + lz77_context_header();
+    c->e.window_bits = window_bits;
+    if (level >= lz77_level_min) {
+        lz77_t status = {0};
+        lz77_encoder_setup(&c->e, window_bits, level);
+        lz77_finder_setup(&status, &c->e.mf, window_bits, level);
+        const size_t head_bytes = sizeof(uint32_t) << c->e.mf.hash_bits;
+        c->e.mf.head = (uint32_t*)p;
+        memset(c->e.mf.head, 0x00, head_bytes);
+        p += head_bytes;
+        c->e.mf.prev = (uint32_t*)p;
+        p += sizeof(uint32_t) << window_bits;
+        if (c->e.parser == lz77_optimal) {
+            c->e.op = (lz77_optimal_t*)p;
+            p += sizeof(lz77_optimal_t);
+        }
+    }
+    c->history = history > 0 ? p : null;
+    c->capacity = history;
+    *context = c;
+    return 0;
+}
+
+static errno_t lz77_context_create(lz77_context_t* *context,
+        uint8_t window_bits, uint8_t level, size_t history) {
+    *context = null;
+    const size_t bytes = lz77_context_bytes(window_bits, level, history);
+    if (bytes == 0) { return EINVAL; }
+    void* memory = lz77_alloc(bytes);
+    if (memory == null) { return ENOMEM; }
+    const errno_t r = lz77_context_init(context, memory, bytes,
+                                        window_bits, level, history);
+    if (r == 0) {
+        (*context)->allocated = true;
+    } else {
+        lz77_free(memory);
+    }
+    return r;
+}
+
+static void lz77_context_dispose(lz77_context_t* c) {
+    if (c != null && c->allocated) { lz77_free(c); }
+}
+
+static errno_t lz77_context_check(const lz77_context_t* c,
+        const lz77_dictionary_t* d, size_t bytes) {
+    const size_t from = d != null ? d->bytes : 0;
+    if (c->e.mf.head == null) { return EINVAL; } // decoder context
+    if (d != null && d->window_bits != c->e.window_bits) { return EINVAL; }
+    if (bytes > UINT32_MAX - from - 2 * (size_t)c->e.mf.window) {
+        return EINVAL;
+    }
+    return 0;
+}
+
+// Message of `bytes` follows the dictionary bytes (if any) in `history`.
+static errno_t lz77_context_encode(lz77_context_t* c,
+        const lz77_dictionary_t* d, const uint8_t* history, size_t bytes,
+        uint8_t* compressed, size_t capacity, size_t *written) {
+    lz77_t lz = { .buffer = compressed, .capacity = capacity };
+    lz77_encoder_t* e = &c->e;
+    lz77_finder_t* mf = &e->mf;
+    const size_t from = d != null ? d->bytes : 0;
+    if ((uint64_t)mf->origin + from + bytes + mf->window > UINT32_MAX) {
+        memset(mf->head, 0x00, sizeof(uint32_t) << mf->hash_bits);
+        mf->origin = 0;
+    }
+    mf->base = d != null ? &d->mf : null;
+    const uint64_t w = (uint64_t)e->window_bits |
+                       (d != null ? (uint64_t)d->id << 32 : 0);
+    lz77_write_word(&lz, (uint64_t)bytes);
+    lz77_write_word(&lz, w);
+    const bool stored = lz77_single_incompressible(history + from, bytes,
+                                                   e->window_bits, null);
+    if (!stored) {
+        lz77_bits_t bits = {0};
+        lz77_write_bits(&lz, &bits.b64, &bits.bp,
+                        e->window_bits | (lz77_version << 5), 16);
+        if (lz.error == 0) {
+            lz77_parse(&lz, e, history, from, from + bytes, &bits);
+        }
+        lz77_write_tail(&lz, &bits);
+    }
+    mf->origin += (uint32_t)(from + bytes); // even after an error
+    if (stored || lz77_single_fallback(&lz, bytes)) {
+        lz = (lz77_t){ .buffer = compressed, .capacity = capacity };
+        lz77_write_word(&lz, (uint64_t)bytes);
+        lz77_write_word(&lz, w);
+        lz77_write_single_stored(&lz, e->window_bits, history + from, bytes,
+                                 null);
+    }
+    *written = lz.error == 0 ? lz.bytes : 0;
+    return lz.error;
+}
+
+// Dictionary `d` bytes in front of c->history for a message of `bytes`.
+// `primed` is only compared: the dictionary it pointed to may be gone.
+static errno_t lz77_context_prime(lz77_context_t* c,
+        const lz77_dictionary_t* d, size_t bytes) {
+    if (d->bytes > c->capacity || bytes > c->capacity - d->bytes) {
+        return EINVAL;
+    }
+    if (c->primed != d || c->primed_id != d->id) {
+        memcpy(c->history, d->data, d->bytes);
+        c->primed = d;
+        c->primed_id = d->id;
+    }
+    return 0;
+}
+
+static errno_t lz77_compress_context(lz77_context_t* c,
+        const lz77_dictionary_t* d, uint8_t* compressed, size_t capacity,
+        const uint8_t* data, size_t bytes, size_t *written) {
+    *written = 0;
+    errno_t r = lz77_context_check(c, d, bytes);
+    if (r == 0 && d != null) { r = lz77_context_prime(c, d, bytes); }
+    if (r == 0 && d != null) { memcpy(c->history + d->bytes, data, bytes); }
+    if (r == 0) {
+        r = lz77_context_encode(c, d, d != null ? c->history : data, bytes,
+                                compressed, capacity, written);
+    }
+    return r;
+}
+
+// Convenience wrapper: allocates the context of the message.
+static errno_t lz77_compress_dictionary(const lz77_dictionary_t* d,
+        uint8_t* compressed, size_t capacity, const uint8_t* data,
+        size_t bytes, uint8_t level, size_t *written) {
+    *written = 0;
+    if (bytes > SIZE_MAX / 2) { return EINVAL; }
+    lz77_context_t* c = null;
+    errno_t r = lz77_context_create(&c, d->window_bits, level,
+                                    d->bytes + bytes);
+    if (r == 0) {
+        r = lz77_compress_context(c, d, compressed, capacity, data, bytes,
+                                  written);
+    }
+    lz77_context_dispose(c);
+    return r;
+}
+
+// Messages without dictionary decode straight into `data`; others
+// behind the dictionary bytes in c->history.
+static errno_t lz77_decompress_context(lz77_context_t* c,
+        const lz77_dictionary_t* d, uint8_t* data, size_t capacity,
+        const uint8_t* compressed, size_t bytes, size_t *decompressed) {
+    if (d == null) {
+        return lz77_decompress_buffer(data, capacity, compressed, bytes,
+                                      decompressed);
+    }
+    lz77_t lz = { .buffer = (uint8_t*)compressed, .bytes = bytes };
+    *decompressed = 0;
+    const uint64_t n = lz77_read_word(&lz);
+    const uint64_t w = lz77_read_word(&lz);
+    if (lz.error != 0) { return lz.error; }
+    if (w != ((uint64_t)d->window_bits | ((uint64_t)d->id << 32)) ||
+        d->window_bits != c->e.window_bits) {
+        return EINVAL; // other dictionary, none or another format
+    }
+    if (n > capacity) { return ENOBUFS; }
+    errno_t r = lz77_context_prime(c, d, (size_t)n);
+    if (r != 0) { return r; }
+    uint8_t* history = c->history;
+    lz77_decoder_t dc = { .left = n, .window_bits = d->window_bits };
+    lz77_single_begin(&lz, &dc);
+    if (lz.error == 0) {
+        lz77_decode_block(&lz, &dc, history, d->bytes, d->bytes + (size_t)n,
+                          history + d->bytes + (size_t)n);
+        lz77_single_end(&lz, &dc);
+    }
+    if (lz.error == 0) {
+        memcpy(data, history + d->bytes, (size_t)n);
+        *decompressed = (size_t)n;
+    }
+    return lz.error;
+}
+
+// Convenience wrapper: allocates the decoder context of the message.
+static errno_t lz77_decompress_dictionary(const lz77_dictionary_t* d,
+        uint8_t* data, size_t capacity, const uint8_t* compressed,
+        size_t bytes, size_t *decompressed) {
+    *decompressed = 0;
+    lz77_t lz = { .buffer = (uint8_t*)compressed, .bytes = bytes };
+    const uint64_t n = lz77_read_word(&lz);
+    if (lz.error != 0) { return lz.error; }
+    // ENOBUFS for `n` over `capacity` is left to decompress_context()
+    const size_t most = n < capacity ? (size_t)n : capacity;
+    if (most > SIZE_MAX / 2) { return EINVAL; }
+    lz77_context_t* c = null;
+    errno_t r = lz77_context_create(&c, d->window_bits, 0, d->bytes + most);
+    if (r == 0) {
+        r = lz77_decompress_context(c, d, data, capacity, compressed, bytes,
+                                    decompressed);
+    }
+    lz77_context_dispose(c);
+    return r;
+}
+
+// Batch of messages: workers take runs of half of the messages left
+// per worker (at least one) under the lock, so there are few of the
+// runs and the last ones are short. Each worker keeps its context
+// (and so the dictionary copied in front of its message history).
+
+typedef struct lz77_batch_s {
+    const lz77_dictionary_t* dictionary;
+    lz77_message_t* messages;
+    size_t          count;
+    size_t          next;    // message to take
+    uint32_t        workers;
+    size_t          history; // of contexts: dictionary + longest message
+    uint8_t         window_bits;
+    uint8_t         level;
+    errno_t         error;   // of a worker setup
+    lz77_sync_t     sync;
+} lz77_batch_t;
+
+static int lz77_batch_worker(void* that) {
+    lz77_batch_t* b = (lz77_batch_t*)that;
+    lz77_context_t* c = null;
+    errno_t r = lz77_context_create(&c, b->window_bits, b->level,
+                                    b->history);
+    lz77_lock(&b->sync);
+    if (r != 0 && b->error == 0) { b->error = r; }
+    while (r == 0 && b->next < b->count) {
+        const size_t left = b->count - b->next;
+        const size_t run = left / (2 * b->workers) + 1;
+        const size_t k = b->next;
+        b->next += run < left ? run : left;
+        const size_t n = b->next;
+        lz77_unlock(&b->sync);
+        for (size_t i = k; i < n; i++) {
+            lz77_message_t* m = &b->messages[i];
+            m->error = lz77_compress_context(c, b->dictionary,
+                m->compressed, m->capacity, m->data, m->bytes, &m->written);
+        }
+        lz77_lock(&b->sync);
+    }
+    lz77_unlock(&b->sync);
+    lz77_context_dispose(c);
+    return 0;
+}
+
+static errno_t lz77_compress_batch(const lz77_dictionary_t* dictionary,
+        uint8_t window_bits, uint8_t level, lz77_message_t* messages,
+        size_t count, uint32_t threads) {
+    if (level < lz77_level_min ||
+        lz77_context_bytes(window_bits, level, 0) == 0) {
+        return EINVAL;
+    }
+    if (dictionary != null && dictionary->window_bits != window_bits) {
+        return EINVAL;
+    }
+    if (count == 0) { return 0; }
+    size_t history = 0;
+    for (size_t i = 0; i < count && dictionary != null; i++) {
+        const size_t n = dictionary->bytes + messages[i].bytes;
+        if (history < n && n <= SIZE_MAX / 2) { history = n; }
+    }
+    lz77_batch_t b = {
+        .dictionary = dictionary, .messages = messages, .count = count,
+        .workers = threads == 0 ? 1 : threads < count ? threads :
+                   (uint32_t)count,
+        .history = history, .window_bits = window_bits, .level = level
+    };
+    errno_t r = lz77_sync_init(&b.sync);
+    if (r != 0) { return r; }
+    lz77_run(lz77_batch_worker, &b, b.workers);
+    lz77_sync_fini(&b.sync);
+    for (size_t i = b.next; i < count; i++) { // no worker was set up
+        messages[i].written = 0;
+        messages[i].error = b.error;
+    }
+    for (size_t i = 0; i < count && r == 0; i++) { r = messages[i].error; }
+    return r;
+}
+
+// Training scores every 8 byte substring by the number of other
+// records it occurs in, cuts records into segments and greedily takes
+// the best scoring ones. Substrings already covered by a taken segment
+// do not count again. Best segments go to the end of the dictionary
+// where distances to them are the shortest.
+
+enum {
+    lz77_train_k        = 8,   // substring length
+    lz77_train_segment  = 256, // bytes
+    lz77_train_bits     = 20   // log2 of substring hash table size
+};
+
+typedef struct lz77_segment_s {
+    size_t   offset; // in samples
+    size_t   bytes;
+    uint64_t score;
+} lz77_segment_t;
+
+static inline uint32_t lz77_train_hash(const uint8_t* p) {
+    return (uint32_t)((lz77_load64(p) * 0x9E3779B97F4A7C15ULL) >>
+                      (64 - lz77_train_bits));
+}
+
+static uint64_t lz77_segment_score(const uint32_t* count, const uint8_t* p,
+        size_t bytes) {
+    uint64_t score = 0;
+    for (size_t i = 0; i + lz77_train_k <= bytes; i++) {
+        const uint32_t c = count[lz77_train_hash(p + i)];
+        score += c > 1 ? c - 1 : 0;
+    }
+    return score;
+}
+
+static void lz77_segment_sift(lz77_segment_t* s, size_t n, size_t i) {
+    for (;;) { // max heap by score
+        size_t top = i;
+        const size_t l = 2 * i + 1;
+        const size_t r = 2 * i + 2;
+        if (l < n && s[l].score > s[top].score) { top = l; }
+        if (r < n && s[r].score > s[top].score) { top = r; }
+        if (top == i) { break; }
+        const lz77_segment_t t = s[i];
+        s[i] = s[top];
+        s[top] = t;
+        i = top;
+    }
+}
+
+static errno_t lz77_dictionary_train(uint8_t* dictionary, size_t capacity,
+        const uint8_t* samples, const size_t* sizes, size_t count,
+        size_t *trained) {
+    *trained = 0;
+    const size_t table = ((size_t)1U) << lz77_train_bits;
+    size_t segments = 0;
+    for (size_t r = 0; r < count; r++) {
+        segments += (sizes[r] + lz77_train_segment - 1) / lz77_train_segment;
+    }
+    uint32_t* counts = (uint32_t*)lz77_alloc(table * sizeof(uint32_t));
+    uint32_t* seen = (uint32_t*)lz77_alloc(table * sizeof(uint32_t));
+    lz77_segment_t* s = (lz77_segment_t*)
+        lz77_alloc(segments * sizeof(lz77_segment_t) + 1);
+    errno_t r = counts == null || seen == null || s == null ? ENOMEM : 0;
+    if (r == 0) {
+        memset(counts, 0x00, table * sizeof(uint32_t));
+        memset(seen, 0x00, table * sizeof(uint32_t));
+        // number of records each substring occurs in
+        size_t offset = 0;
+        for (size_t k = 0; k < count; k++) {
+            const uint8_t* p = samples + offset;
+            for (size_t i = 0; i + lz77_train_k <= sizes[k]; i++) {
+                const uint32_t h = lz77_train_hash(p + i);
+                if (seen[h] != k + 1) {
+                    seen[h] = (uint32_t)(k + 1);
+                    counts[h]++;
+                }
+            }
+            offset += sizes[k];
+        }
+        size_t n = 0;
+        offset = 0;
+        for (size_t k = 0; k < count; k++) {
+            for (size_t i = 0; i < sizes[k]; i += lz77_train_segment) {
+                s[n].offset = offset + i;
+                s[n].bytes = sizes[k] - i < lz77_train_segment ?
+                             sizes[k] - i : lz77_train_segment;
+                s[n].score = lz77_segment_score(counts, samples + s[n].offset,
+                                                s[n].bytes);
+                n++;
+            }
+            offset += sizes[k];
+        }
+        for (size_t k = n / 2; k-- > 0; ) { lz77_segment_sift(s, n, k); }
+        size_t end = capacity; // dictionary is filled from the end
+        while (n > 0 && s[0].score > 0 && end > 0) {
+            const uint8_t* p = samples + s[0].offset;
+            // taken segments make their substrings worthless: scores
+            // only go down and the stale one is re-queued if it did
+            const uint64_t score = lz77_segment_score(counts, p, s[0].bytes);
+            if (score < s[0].score) {
+                s[0].score = score;
+                lz77_segment_sift(s, n, 0);
+                continue;
+            }
+            const size_t bytes = s[0].bytes < end ? s[0].bytes : end;
+            end -= bytes;
+            memcpy(dictionary + end, p + s[0].bytes - bytes, bytes);
+            for (size_t i = 0; i + lz77_train_k <= s[0].bytes; i++) {
+                counts[lz77_train_hash(p + i)] = 0;
+            }
+            s[0] = s[--n];
+            lz77_segment_sift(s, n, 0);
+        }
+        memmove(dictionary, dictionary + end, capacity - end);
+        *trained = capacity - end;
+    }
+    if (s != null) { lz77_free(s); }
+    if (seen != null) { lz77_free(seen); }
+    if (counts != null) { lz77_free(counts); }
+    return r;
+}
+
+lz77_if lz77 = {
+    .write_header          = lz77_write_header,
+    .compress              = lz77_compress,
+    .compress_level        = lz77_compress_level,
+    .read_header           = lz77_read_header,
+    .decompress            = lz77_decompress,
+    .compress_bound        = lz77_compress_bound,
+    .compress_buffer       = lz77_compress_buffer,
+    .compress_buffer_ex    = lz77_compress_buffer_ex,
+    .decompress_buffer     = lz77_decompress_buffer,
+    .compress_begin        = lz77_compress_begin,
+    .compress_update       = lz77_compress_update,
+    .compress_finish       = lz77_compress_finish,
+    .decompress_begin      = lz77_decompress_begin,
+    .decompress_read       = lz77_decompress_read,
+    .decompress_stream     = lz77_decompress_stream,
+    .decompress_finish     = lz77_decompress_finish,
+    .compress_parallel     = lz77_compress_parallel,
+    .decompress_range      = lz77_decompress_range,
+    .decompress_parallel   = lz77_decompress_parallel,
+    .dictionary_create     = lz77_dictionary_create,
+    .dictionary_id         = lz77_dictionary_id,
+    .dictionary_dispose    = lz77_dictionary_dispose,
+    .compress_dictionary   = lz77_compress_dictionary,
+    .decompress_dictionary = lz77_decompress_dictionary,
+    .dictionary_train      = lz77_dictionary_train,
+    .context_bytes         = lz77_context_bytes,
+    .context_init          = lz77_context_init,
+    .context_create        = lz77_context_create,
+    .context_dispose       = lz77_context_dispose,
+    .compress_context      = lz77_compress_context,
+    .decompress_context    = lz77_decompress_context,
+    .pipe_begin            = lz77_pipe_begin,
+    .pipe_end              = lz77_pipe_end,
+    .auto_window_bits      = lz77_auto_window_bits,
+    .compress_batch        = lz77_compress_batch,
+};
+
+#pragma pop_macro("lz77_signal")
+#pragma pop_macro("lz77_wait")
+#pragma pop_macro("lz77_unlock")
+#pragma pop_macro("lz77_lock")
 
 #pragma pop_macro("lz77_if_error_return")
 #pragma pop_macro("return_invalid")
 
+#pragma pop_macro("write_match")
+#pragma pop_macro("write_literal")
 #pragma pop_macro("write_number")
 #pragma pop_macro("write_bits")
 #pragma pop_macro("write_bit")
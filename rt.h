@@ -4,6 +4,14 @@
 
 // nano runtime to make debugging, life, universe and everything a bit easier
 
+// ftruncate() and madvise() with -std=c11 need _DEFAULT_SOURCE before
+// the first system header of the translation unit: files that include
+// anything before rt.h must define it themselves (see test.c).
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -91,4 +99,182 @@ static int32_t rt_exit(int exit_code) {
     return 0;
 }
 
+// Files are mapped instead of read into the heap: input pages are
+// shared with the page cache and output is written straight to it.
+// rt_map_file() maps existing file read only (empty file is null),
+// rt_map_new_file() creates file of `bytes` and maps it for writing.
+// Both return 0 or errno. On Windows mapping needs NEED_WIN32_API
+// (see test.c); without it files are read into and written from heap
+// memory that rt_unmap_file() releases.
+
+#if defined(_WIN32) && !defined(NEED_WIN32_API)
+
+typedef struct rt_mapping_s { // in front of the data
+    FILE*    f; // null for read only
+    uint64_t bytes;
+} rt_mapping_t;
+
+static inline int rt_map(const char* fn, bool write, uint64_t* bytes, void* *data) {
+    *data = null;
+    FILE* f = fopen(fn, write ? "wb" : "rb");
+    if (f == null) { return errno; }
+    int r = 0;
+    if (!write) {
+        if (_fseeki64(f, 0, SEEK_END) != 0) { r = errno; }
+        const int64_t size = r == 0 ? _ftelli64(f) : 0;
+        if (r == 0 && size < 0) { r = errno; }
+        if (r == 0 && _fseeki64(f, 0, SEEK_SET) != 0) { r = errno; }
+        if (r == 0) { *bytes = (uint64_t)size; }
+    }
+    if (r == 0 && *bytes > SIZE_MAX - sizeof(rt_mapping_t)) { r = E2BIG; }
+    rt_mapping_t* m = null;
+    if (r == 0 && *bytes > 0) {
+        m = (rt_mapping_t*)malloc(sizeof(rt_mapping_t) + (size_t)*bytes);
+        if (m == null) { r = ENOMEM; }
+    }
+    if (m != null) {
+        m->f = write ? f : null;
+        m->bytes = *bytes;
+        if (!write && fread(m + 1, 1, (size_t)*bytes, f) != *bytes) {
+            r = EIO;
+            free(m);
+            m = null;
+        }
+    }
+    if (m != null) { *data = m + 1; }
+    if (!write || m == null) { fclose(f); }
+    return r;
+}
+
+static inline int rt_unmap_file(const void* data, size_t bytes) {
+    if (data == null) { return 0; }
+    rt_mapping_t* m = (rt_mapping_t*)data - 1;
+    int r = 0;
+    if (m->f != null) {
+        if (fwrite(data, 1, bytes, m->f) != bytes) { r = EIO; }
+        if (fclose(m->f) != 0 && r == 0) { r = EIO; }
+    }
+    free(m);
+    return r;
+}
+
+#elif defined(_WIN32)
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+
+static inline int rt_map_error(void) {
+    switch (GetLastError()) {
+        case ERROR_FILE_NOT_FOUND:
+        case ERROR_PATH_NOT_FOUND:    return ENOENT;
+        case ERROR_ACCESS_DENIED:     return EACCES;
+        case ERROR_NOT_ENOUGH_MEMORY: return ENOMEM;
+        case ERROR_DISK_FULL:         return ENOSPC;
+        default:                      return EIO;
+    }
+}
+
+static inline int rt_map(const char* fn, bool write, uint64_t* bytes, void* *data) {
+    *data = null;
+    HANDLE f = CreateFileA(fn, write ? GENERIC_READ | GENERIC_WRITE :
+        GENERIC_READ, write ? 0 : FILE_SHARE_READ, null,
+        write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+        null);
+    if (f == INVALID_HANDLE_VALUE) { return rt_map_error(); }
+    int r = 0;
+    LARGE_INTEGER size = { .QuadPart = (LONGLONG)*bytes };
+    if (!write && !GetFileSizeEx(f, &size)) { r = rt_map_error(); }
+    if (r == 0 && (uint64_t)size.QuadPart > SIZE_MAX) { r = E2BIG; }
+    if (r == 0 && size.QuadPart > 0) {
+        // mapping of `size` extends new file to it
+        HANDLE m = CreateFileMappingA(f, null,
+            write ? PAGE_READWRITE : PAGE_READONLY,
+            (DWORD)(size.QuadPart >> 32), (DWORD)size.QuadPart, null);
+        if (m == null) {
+            r = rt_map_error();
+        } else {
+            *data = MapViewOfFile(m, write ? FILE_MAP_WRITE : FILE_MAP_READ,
+                                  0, 0, (SIZE_T)size.QuadPart);
+            if (*data == null) { r = rt_map_error(); }
+            CloseHandle(m); // view keeps mapping alive
+        }
+    }
+    if (r == 0) { *bytes = (uint64_t)size.QuadPart; }
+    CloseHandle(f);
+    return r;
+}
+
+static inline int rt_unmap_file(const void* data, size_t bytes) {
+    (void)bytes;
+    return data == null || UnmapViewOfFile(data) ? 0 : rt_map_error();
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static inline int rt_map(const char* fn, bool write, uint64_t* bytes, void* *data) {
+    *data = null;
+    int fd = write ? open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644) :
+                     open(fn, O_RDONLY);
+    if (fd < 0) { return errno; }
+    int r = 0;
+    struct stat st = {0};
+    if (write) {
+        if (*bytes > INT64_MAX || ftruncate(fd, (off_t)*bytes) != 0) {
+            r = *bytes > INT64_MAX ? E2BIG : errno;
+        }
+    } else if (fstat(fd, &st) != 0) {
+        r = errno;
+    } else {
+        *bytes = (uint64_t)st.st_size;
+    }
+    if (r == 0 && *bytes > SIZE_MAX) { r = E2BIG; }
+    if (r == 0 && *bytes > 0) {
+        void* p = mmap(null, (size_t)*bytes,
+                       write ? PROT_READ | PROT_WRITE : PROT_READ,
+                       write ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            r = errno;
+        } else {
+            #ifdef MADV_SEQUENTIAL // only a hint
+            (void)madvise(p, (size_t)*bytes, MADV_SEQUENTIAL);
+            #endif
+            *data = p;
+        }
+    }
+    (void)close(fd); // mapping keeps file alive
+    return r;
+}
+
+static inline int rt_unmap_file(const void* data, size_t bytes) {
+    return data == null || munmap((void*)data, bytes) == 0 ? 0 : errno;
+}
+
+#endif
+
+static inline int rt_map_file(const char* fn, const uint8_t* *data, size_t *bytes) {
+    uint64_t size = 0;
+    void* p = null;
+    int r = rt_map(fn, false, &size, &p);
+    *data = (const uint8_t*)p;
+    *bytes = r == 0 ? (size_t)size : 0;
+    return r;
+}
+
+static inline int rt_map_new_file(const char* fn, uint8_t* *data, size_t bytes) {
+    uint64_t size = bytes;
+    void* p = null;
+    int r = rt_map(fn, true, &size, &p);
+    *data = (uint8_t*)p;
+    return r;
+}
+
 #endif // rt_h
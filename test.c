@@ -5,6 +5,10 @@
 #pragma warning(disable: 4711) // function selected for automatic inline expansion
 #endif
 
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // before any system header: ftruncate() in rt.h
+#endif
+
 #include "lz77.h"
 #include "rt.h"
 
@@ -42,6 +46,25 @@ static void file_write(lz77_t* lz, uint64_t buffer) {
     }
 }
 
+static size_t file_read_block(lz77_t* lz, void* data, size_t bytes) {
+    size_t n = 0;
+    if (lz->error == 0) {
+        FILE* f = (FILE*)lz->that;
+        n = fread(data, 1, bytes, f);
+        if (n < bytes && ferror(f)) { lz->error = errno; }
+    }
+    return n;
+}
+
+static void file_write_block(lz77_t* lz, const void* data, size_t bytes) {
+    if (lz->error == 0) {
+        FILE* f = (FILE*)lz->that;
+        if (fwrite(data, 1, bytes, f) != bytes) {
+            lz->error = errno;
+        }
+    }
+}
+
 static bool file_exist(const char* filename) {
     struct stat st = {0};
     return stat(filename, &st) == 0;
@@ -49,6 +72,14 @@ static bool file_exist(const char* filename) {
 
 static const char* input_file;
 
+static uint8_t level = lz77_level_default;
+
+static bool block_io = true; // read_block()/write_block() vs read()/write()
+
+static bool pipelined = false; // block I/O on pipe_begin() thread
+
+static uint8_t io_buffer[64 * 1024];
+
 static errno_t compress(const char* fn, const uint8_t* data, size_t bytes) {
     FILE* out = null; // compressed file
     errno_t r = fopen_s(&out, fn, "wb") != 0;
@@ -60,8 +91,15 @@ static errno_t compress(const char* fn, const uint8_t* data, size_t bytes) {
         .that = (void*)out,
         .write = file_write
     };
+    if (block_io) {
+        lz.write_block = file_write_block;
+        lz.buffer = io_buffer;
+        lz.capacity = pipelined ? 3 * 1024 : sizeof(io_buffer);
+        if (pipelined) { lz77.pipe_begin(&lz, 3); }
+    }
     lz77.write_header(&lz, bytes, lzn_window_bits);
-    lz77.compress(&lz, data, bytes, lzn_window_bits);
+    lz77.compress_level(&lz, data, bytes, lzn_window_bits, level);
+    lz77.pipe_end(&lz);
     rt_assert(lz.error == 0);
     r = fclose(out) == 0 ? 0 : errno; // e.g. overflow writing buffered output
     if (r != 0) {
@@ -73,8 +111,8 @@ static errno_t compress(const char* fn, const uint8_t* data, size_t bytes) {
         } else {
             double percent = lz.written * 100.0 / bytes;
             if (input_file != null) {
-                rt_println("%7lld -> %7lld %5.1f%% of \"%s\"",
-                            bytes, lz.written, percent, input_file);
+                rt_println("%7lld -> %7lld %5.1f%% of \"%s\" level: %d",
+                            bytes, lz.written, percent, input_file, level);
             } else {
                 rt_println("%7lld -> %7lld %5.1f%%",
                             bytes, lz.written, percent);
@@ -96,18 +134,28 @@ static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
         .that = (void*)in,
         .read = file_read
     };
+    if (block_io) {
+        lz.read_block = file_read_block;
+        lz.buffer = io_buffer;
+        lz.capacity = pipelined ? 2 * 1024 : sizeof(io_buffer);
+        if (pipelined) { lz77.pipe_begin(&lz, 2); }
+    }
     size_t bytes = 0;
     uint8_t window_bits = 0;
     lz77.read_header(&lz, &bytes, &window_bits);
     rt_assert(lz.error == 0 && bytes == size && window_bits == lzn_window_bits);
-    uint8_t* data = (uint8_t*)malloc(bytes + 1);
-    if (data == null) {
-        rt_println("Failed to allocate memory for decompressed data");
+    // decompress straight into the page cache of the output file
+    const char* decompressed = "~decompressed~.bin";
+    uint8_t* data = null;
+    r = rt_map_new_file(decompressed, &data, bytes);
+    if (r != 0) {
+        rt_println("Failed to map \"%s\": %s", decompressed, strerror(r));
+        lz77.pipe_end(&lz);
         fclose(in);
-        return ENOMEM;
+        return r;
     }
-    data[bytes] = 0x00;
     lz77.decompress(&lz, data, bytes, lzn_window_bits);
+    lz77.pipe_end(&lz);
     fclose(in);
     rt_assert(lz.error == 0);
     if (lz.error == 0) {
@@ -118,57 +166,920 @@ static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
             // ENODATA is not original posix error but is OpenGroup error
             r = ENODATA; // or EIO
         } else if (bytes < 128) {
-            rt_println("decompressed: %s", data);
+            rt_println("decompressed: %.*s", (int)bytes, data);
         }
     }
-    free(data);
+    (void)rt_unmap_file(data, bytes);
+    (void)remove(decompressed);
     if (r != 0) {
         rt_println("Failed to decompress");
     }
     return r;
 }
 
-static errno_t file_size(FILE* f, size_t* size) {
-    // on error returns (fpos_t)-1 and sets errno
-    fpos_t pos = 0;
-    if (fgetpos(f, &pos) != 0) { return errno; }
-    if (fseek(f, 0, SEEK_END) != 0) { return errno; }
-    fpos_t eof = 0;
-    if (fgetpos(f, &eof) != 0) { return errno; }
-    if (fseek(f, 0, SEEK_SET) != 0) { return errno; }
-    if ((uint64_t)eof > SIZE_MAX) { return E2BIG; }
-    *size = (size_t)eof;
-    return 0;
+typedef struct expected_s {
+    const uint8_t* data;
+    size_t bytes;
+    size_t offset; // of the next byte to compare
+} expected_t;
+
+static void sink(lz77_t* lz, const uint8_t* data, size_t bytes) {
+    expected_t* e = (expected_t*)lz->that;
+    if (bytes > e->bytes - e->offset ||
+        memcmp(e->data + e->offset, data, bytes) != 0) {
+        lz->error = ENODATA;
+    } else {
+        e->offset += bytes;
+    }
 }
 
-static errno_t read_fully(FILE* f, const uint8_t* *data, size_t *bytes) {
-    size_t size = 0;
-    errno_t r = file_size(f, &size);
-    if (r != 0) { return r; }
-    if (size > SIZE_MAX) { return E2BIG; }
-    uint8_t* p = (uint8_t*)malloc(size); // does set errno on failure
-    if (p == null) { return errno; }
-    if (fread(p, 1, size, f) != (size_t)size) { free(p); return errno; }
-    *data = p;
-    *bytes = (size_t)size;
-    return 0;
+static errno_t test_pull(const uint8_t* compressed, size_t written,
+        const uint8_t* data, size_t bytes) {
+    // decompress_read() in chunks of varying sizes
+    uint8_t chunk[1000];
+    lz77_t lz = { .buffer = (uint8_t*)compressed, .bytes = written };
+    lz77.decompress_begin(&lz);
+    size_t i = 0;
+    size_t n = 1;
+    for (;;) {
+        const size_t k = lz77.decompress_read(&lz, chunk, n);
+        if (k > bytes - i || memcmp(data + i, chunk, k) != 0) {
+            lz.error = ENODATA;
+        }
+        if (lz.error != 0 || k == 0) { break; }
+        i += k;
+        n = n * 3 % sizeof(chunk) + 1;
+    }
+    lz77.decompress_finish(&lz);
+    rt_assert(lz.error == 0 && i == bytes && lz.decoder == null);
+    errno_t r = lz.error == 0 && i != bytes ? ENODATA : lz.error;
+    if (r == 0) { // decompress_stream() into sink()
+        expected_t e = { .data = data, .bytes = bytes };
+        lz77_t ls = { .that = &e, .buffer = (uint8_t*)compressed,
+                      .bytes = written };
+        lz77.decompress_begin(&ls);
+        lz77.decompress_stream(&ls, sink);
+        lz77.decompress_finish(&ls);
+        rt_assert(ls.error == 0 && e.offset == bytes);
+        r = ls.error == 0 && e.offset != bytes ? ENODATA : ls.error;
+    }
+    if (r != 0) {
+        rt_println("Failed to decompress_read()/decompress_stream(): %s",
+                   strerror(r));
+    }
+    return r;
 }
 
-static errno_t read_whole_file(const char* fn, const uint8_t* *data, size_t *bytes) {
-    FILE* f = null;
-    errno_t r = fopen_s(&f, fn, "rb");
+static errno_t test_buffer(const uint8_t* data, size_t bytes) {
+    // memory to memory without callbacks
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(bytes + 1);
+    if (compressed == null || decompressed == null) {
+        free(compressed);
+        free(decompressed);
+        return ENOMEM;
+    }
+    size_t written = 0;
+    errno_t r = lz77.compress_buffer(compressed, capacity, data, bytes,
+                                     lzn_window_bits, &written);
+    rt_assert(r == 0 && written <= capacity);
+    size_t n = 0;
+    if (r == 0) {
+        r = lz77.decompress_buffer(decompressed, bytes, compressed, written, &n);
+        rt_assert(r == 0);
+    }
+    if (r == 0 && (n != bytes || memcmp(data, decompressed, bytes) != 0)) {
+        rt_println("compress_buffer() and decompress_buffer() are not the same");
+        r = ENODATA;
+    }
+    if (r == 0) { r = test_pull(compressed, written, data, bytes); }
+    if (r == 0 && written > 2 * sizeof(uint64_t)) {
+        size_t too_small = 0;
+        errno_t e = lz77.compress_buffer(compressed, written - 1, data, bytes,
+                                         lzn_window_bits, &too_small);
+        rt_assert(e == ENOBUFS && too_small == 0);
+        if (e != ENOBUFS) { r = EINVAL; }
+    }
+    free(compressed);
+    free(decompressed);
     if (r != 0) {
-        rt_println("Failed to open file \"%s\": %s", FILE_NAME, strerror(r));
-        return r;
+        rt_println("Failed to compress_buffer()/decompress_buffer(): %s",
+                   strerror(r));
+    }
+    return r;
+}
+
+static errno_t test_stream(const uint8_t* data, size_t bytes) {
+    // input in chunks of varying sizes, some bigger than a block
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(bytes + 1);
+    if (compressed == null || decompressed == null) {
+        free(compressed);
+        free(decompressed);
+        return ENOMEM;
+    }
+    lz77_t lz = { .buffer = compressed, .capacity = capacity };
+    lz77.compress_begin(&lz, lzn_window_bits, level);
+    size_t i = 0;
+    size_t chunk = 1;
+    while (i < bytes && lz.error == 0) {
+        const size_t n = chunk < bytes - i ? chunk : bytes - i;
+        lz77.compress_update(&lz, data + i, n);
+        i += n;
+        chunk = chunk * 7 % 200003 + 1;
+    }
+    lz77.compress_finish(&lz);
+    errno_t r = lz.error;
+    rt_assert(r == 0 && lz.bytes <= capacity && lz.encoder == null);
+    // blocks that do not shrink are stored: header, padding and end only
+    rt_assert(lz.bytes <= bytes + 32 + 24 * (bytes / (64 * 1024) + 1));
+    size_t n = 0;
+    if (r == 0) {
+        r = lz77.decompress_buffer(decompressed, bytes, compressed, lz.bytes, &n);
+        rt_assert(r == 0);
+    }
+    if (r == 0 && (n != bytes || memcmp(data, decompressed, bytes) != 0)) {
+        rt_println("compress_update() and decompress_buffer() are not the same");
+        r = ENODATA;
     }
-    r = read_fully(f, data, bytes); // to the heap
-    (void)fclose(f); // file was open for reading fclose() should not fail
+    if (r == 0) { r = test_pull(compressed, lz.bytes, data, bytes); }
+    free(compressed);
+    free(decompressed);
     if (r != 0) {
-        rt_println("Failed to read file \"%s\": %s", FILE_NAME, strerror(r));
-        fclose(f);
-        return r;
+        rt_println("Failed to compress_update()/decompress_buffer(): %s",
+                   strerror(r));
+    }
+    return r;
+}
+
+static errno_t test_parallel(const uint8_t* data, size_t bytes) {
+    // output must be the same for any number of threads
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* compressed[2] = { (uint8_t*)malloc(capacity),
+                               (uint8_t*)malloc(capacity) };
+    uint8_t* decompressed = (uint8_t*)malloc(bytes + 1);
+    if (compressed[0] == null || compressed[1] == null || decompressed == null) {
+        free(compressed[0]);
+        free(compressed[1]);
+        free(decompressed);
+        return ENOMEM;
+    }
+    errno_t r = 0;
+    for (int32_t history = 0; history <= 1 && r == 0; history++) {
+        const uint32_t threads[2] = { 1, 4 };
+        lz77_t lz[2] = {0};
+        for (int32_t i = 0; i < 2; i++) {
+            lz[i].buffer = compressed[i];
+            lz[i].capacity = capacity;
+            lz[i].checksum = history; // verified by all the decoders below
+            lz77.compress_parallel(&lz[i], data, bytes, lzn_window_bits,
+                                   level, 16, history, threads[i]);
+        }
+        rt_assert(lz[0].error == 0 && lz[1].error == 0);
+        r = lz[0].error != 0 ? lz[0].error : lz[1].error;
+        if (r == 0 && (lz[0].bytes != lz[1].bytes ||
+            memcmp(compressed[0], compressed[1], lz[0].bytes) != 0)) {
+            rt_println("compress_parallel() depends on number of threads");
+            r = EINVAL;
+        }
+        size_t n = 0;
+        if (r == 0) {
+            r = lz77.decompress_buffer(decompressed, bytes, compressed[0],
+                                       lz[0].bytes, &n);
+            rt_assert(r == 0);
+        }
+        if (r == 0 && (n != bytes || memcmp(data, decompressed, bytes) != 0)) {
+            rt_println("compress_parallel() and decompress_buffer() are not the same");
+            r = ENODATA;
+        }
+        if (r == 0) {
+            memset(decompressed, 0x00, bytes);
+            r = lz77.decompress_parallel(decompressed, bytes, compressed[0],
+                                         lz[0].bytes, 4, &n);
+            rt_assert(r == 0);
+        }
+        if (r == 0 && (n != bytes || memcmp(data, decompressed, bytes) != 0)) {
+            rt_println("compress_parallel() and decompress_parallel() are not the same");
+            r = ENODATA;
+        }
+        // ranges inside, across and at the ends of blocks
+        const uint64_t ranges[][2] = {
+            { 0, bytes }, { 0, 1 }, { bytes / 2, bytes / 2 },
+            { bytes / 3, bytes / 2 + 1 }, { bytes - 1, bytes },
+            { 65535, 65537 }, { 70000, 200000 }
+        };
+        for (size_t i = 0; i < rt_countof(ranges) && r == 0; i++) {
+            const uint64_t from = ranges[i][0];
+            const uint64_t to = ranges[i][1];
+            if (from <= to && to <= bytes) {
+                r = lz77.decompress_range(decompressed, compressed[1],
+                        lz[1].bytes, from, to);
+                rt_assert(r == 0);
+                if (r == 0 && memcmp(data + from, decompressed, to - from) != 0) {
+                    rt_println("decompress_range(%lld, %lld) is not the same",
+                               from, to);
+                    r = ENODATA;
+                }
+            }
+        }
     }
-    return fclose(f) == 0 ? 0 : errno;
+    free(compressed[0]);
+    free(compressed[1]);
+    free(decompressed);
+    if (r != 0) {
+        rt_println("Failed to compress_parallel(): %s", strerror(r));
+    }
+    return r;
+}
+
+static errno_t test_stats(const uint8_t* data, size_t bytes) {
+    // tokens counted by compressor and decompressor must be the same
+    // and account for every bit of the single format stream
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(bytes + 1);
+    if (compressed == null || decompressed == null) {
+        free(compressed);
+        free(decompressed);
+        return ENOMEM;
+    }
+    errno_t r = 0;
+    for (int32_t blocks = 0; blocks <= 1 && r == 0; blocks++) {
+        lz77_stats_t cs = {0};
+        lz77_t lz = { .buffer = compressed, .capacity = capacity, .stats = &cs };
+        if (blocks) {
+            lz77.compress_begin(&lz, lzn_window_bits, level);
+            lz77.compress_update(&lz, data, bytes);
+            lz77.compress_finish(&lz);
+        } else {
+            lz77.write_header(&lz, bytes, lzn_window_bits);
+            lz77.compress_level(&lz, data, bytes, lzn_window_bits, level);
+        }
+        r = lz.error;
+        rt_assert(r == 0);
+        const uint64_t bits = 16 + cs.literal_bits + cs.match_bits;
+        const bool stored = !blocks && (compressed[17] & 1) != 0;
+        if (r == 0 && !blocks && !stored &&
+            lz.bytes != 16 + (bits + 63) / 64 * 8) {
+            rt_println("stats: %lld bits in %lld bytes", bits, lz.bytes);
+            r = EINVAL;
+        }
+        lz77_stats_t ds = {0};
+        lz77_t d = { .buffer = compressed, .bytes = lz.bytes, .stats = &ds };
+        if (r == 0) {
+            lz77.decompress_begin(&d);
+            const size_t n = lz77.decompress_read(&d, decompressed, bytes + 1);
+            lz77.decompress_finish(&d);
+            r = d.error;
+            if (r == 0 && n != bytes) { r = ENODATA; }
+            rt_assert(r == 0);
+        }
+        // decompressor does not search: compare up to the probes
+        if (r == 0 && (cs.literals[0] + cs.literals[1] > bytes ||
+            memcmp(&cs, &ds, offsetof(lz77_stats_t, probes)) != 0)) {
+            rt_println("stats: compress and decompress differ");
+            r = EINVAL;
+        }
+    }
+    free(compressed);
+    free(decompressed);
+    return r;
+}
+
+static size_t test_record(char* record, size_t capacity, uint32_t k) {
+    // small JSON log records sharing keys and most values
+    static const char* levels[] = { "info", "warning", "error" };
+    static const char* services[] = { "auth", "billing", "search", "storage" };
+    const int n = snprintf(record, capacity,
+        "{\"timestamp\":\"2024-03-%02d T%02d:%02d:%02d\",\"level\":\"%s\","
+        "\"service\":\"%s\",\"request_id\":%u,\"latency_ms\":%u,"
+        "\"message\":\"request completed for user %u\"}",
+        1 + k % 28, k % 24, k * 7 % 60, k * 13 % 60, levels[k % 3],
+        services[k * 5 % 4], 100000 + k * 7919, k * 31 % 500, k * 17 % 1000);
+    return (size_t)n;
+}
+
+static errno_t test_dictionary(void) {
+    // records compress better with trained dictionary and only with it
+    enum { samples = 256, messages = 64, capacity = 4 * 1024 };
+    static uint8_t data[samples * 256];
+    static size_t sizes[samples];
+    static uint8_t trained[capacity];
+    size_t bytes = 0;
+    for (uint32_t k = 0; k < samples; k++) {
+        sizes[k] = test_record((char*)data + bytes, sizeof(data) - bytes, k);
+        bytes += sizes[k];
+    }
+    size_t n = 0;
+    errno_t r = lz77.dictionary_train(trained, capacity, data, sizes,
+                                      samples, &n);
+    rt_assert(r == 0 && 0 < n && n <= capacity);
+    lz77_dictionary_t* dictionary = null;
+    lz77_dictionary_t* other = null;
+    if (r == 0) {
+        r = lz77.dictionary_create(&dictionary, trained, n, lzn_window_bits);
+    }
+    if (r == 0) {
+        r = lz77.dictionary_create(&other, data, bytes, lzn_window_bits);
+    }
+    rt_assert(r == 0 && lz77.dictionary_id(dictionary) != lz77.dictionary_id(other));
+    size_t with = 0;
+    size_t without = 0;
+    for (uint32_t k = samples; k < samples + messages && r == 0; k++) {
+        char record[256];
+        uint8_t compressed[512];
+        uint8_t decompressed[256];
+        const size_t bytes = test_record(record, sizeof(record), k);
+        size_t written = 0;
+        r = lz77.compress_buffer(compressed, sizeof(compressed),
+                (uint8_t*)record, bytes, lzn_window_bits, &written);
+        without += written;
+        if (r == 0) {
+            r = lz77.compress_dictionary(dictionary, compressed,
+                    sizeof(compressed), (uint8_t*)record, bytes, level,
+                    &written);
+            with += written;
+        }
+        rt_assert(r == 0);
+        size_t m = 0;
+        if (r == 0) {
+            r = lz77.decompress_dictionary(dictionary, decompressed,
+                    sizeof(decompressed), compressed, written, &m);
+            rt_assert(r == 0);
+        }
+        if (r == 0 && (m != bytes || memcmp(record, decompressed, m) != 0)) {
+            rt_println("compress_dictionary() and decompress_dictionary() "
+                       "are not the same");
+            r = ENODATA;
+        }
+        if (r == 0 && (lz77.decompress_dictionary(other, decompressed,
+                sizeof(decompressed), compressed, written, &m) != EINVAL ||
+            lz77.decompress_buffer(decompressed, sizeof(decompressed),
+                compressed, written, &m) != EINVAL)) {
+            rt_println("decompressed without the dictionary");
+            r = EINVAL;
+        }
+    }
+    if (r == 0) {
+        rt_println("%d records: %lld bytes with dictionary of %lld bytes, "
+                   "%lld without", messages, with, n, without);
+    }
+    if (r == 0 && with >= without) { r = EINVAL; }
+    lz77.dictionary_dispose(dictionary);
+    lz77.dictionary_dispose(other);
+    return r;
+}
+
+static errno_t test_context(void) {
+    // one context for many messages produces the same bytes as fresh state
+    // and a decoder context in caller memory decodes them
+    enum { messages = 64, history = (1 << lzn_window_bits) + 256 };
+    static uint64_t memory[64 * 1024];
+    static uint64_t decoder[1024];
+    const size_t bytes = lz77.context_bytes(lzn_window_bits, lz77_level_max,
+                                            history);
+    const size_t decoder_bytes = lz77.context_bytes(lzn_window_bits, 0,
+                                                    history);
+    rt_assert(0 < bytes && bytes <= sizeof(memory));
+    rt_assert(0 < decoder_bytes && decoder_bytes <= sizeof(decoder));
+    rt_assert(lz77.context_bytes(9, level, 0) == 0);
+    lz77_context_t* dc = null;
+    lz77_dictionary_t* dictionary = null;
+    lz77_context_t* created = null;
+    lz77_context_t* placed = null;
+    static uint8_t data[16 * 1024];
+    size_t n = 0;
+    for (uint32_t k = 0; n < sizeof(data) - 256; k++) {
+        n += test_record((char*)data + n, sizeof(data) - n, k);
+    }
+    errno_t r = lz77.dictionary_create(&dictionary, data, n, lzn_window_bits);
+    lz77_dictionary_t* half = null; // messages alternate dictionaries
+    if (r == 0) {
+        r = lz77.dictionary_create(&half, data, n / 2, lzn_window_bits);
+    }
+    if (r == 0) {
+        r = lz77.context_create(&created, lzn_window_bits, level, 0);
+    }
+    if (r == 0) {
+        rt_assert(lz77.context_init(&placed, memory, bytes - 1,
+                  lzn_window_bits, lz77_level_max, history) == ENOBUFS);
+        r = lz77.context_init(&placed, memory, bytes, lzn_window_bits,
+                              lz77_level_max, history);
+    }
+    if (r == 0) {
+        r = lz77.context_init(&dc, decoder, decoder_bytes, lzn_window_bits,
+                              0, history);
+    }
+    for (uint32_t k = 0; k < messages && r == 0; k++) {
+        char record[256];
+        uint8_t expected[512];
+        uint8_t compressed[512];
+        const size_t length = test_record(record, sizeof(record), 1000 + k);
+        size_t e = 0;
+        size_t written = 0;
+        r = lz77.compress_buffer(expected, sizeof(expected),
+                (uint8_t*)record, length, lzn_window_bits, &e);
+        if (r == 0) {
+            r = lz77.compress_context(created, null, compressed,
+                    sizeof(compressed), (uint8_t*)record, length, &written);
+        }
+        if (r == 0 && (written != e || memcmp(expected, compressed, e) != 0)) {
+            r = ENODATA;
+        }
+        const lz77_dictionary_t* d = k % 3 == 2 ? half : dictionary;
+        if (r == 0) {
+            r = lz77.compress_dictionary(d, expected, sizeof(expected),
+                    (uint8_t*)record, length, lz77_level_max, &e);
+        }
+        if (r == 0) {
+            r = lz77.compress_context(placed, d, compressed,
+                    sizeof(compressed), (uint8_t*)record, length, &written);
+        }
+        if (r == 0 && (written != e || memcmp(expected, compressed, e) != 0)) {
+            r = ENODATA;
+        }
+        if (r == ENODATA) {
+            rt_println("compress_context() is not the same");
+        }
+        uint8_t decompressed[256];
+        size_t m = 0;
+        if (r == 0) {
+            r = lz77.decompress_context(dc, d, decompressed,
+                    sizeof(decompressed), compressed, written, &m);
+        }
+        if (r == 0 && (m != length || memcmp(record, decompressed, m))) {
+            rt_println("decompress_context() is not the same");
+            r = ENODATA;
+        }
+    }
+    if (r == 0) { // over the history of the context or for decoding only
+        uint8_t compressed[512];
+        size_t written = 0;
+        const size_t over = history - (1 << lzn_window_bits) + 1;
+        if (lz77.compress_context(placed, dictionary, compressed,
+                sizeof(compressed), data, over, &written) != EINVAL ||
+            lz77.compress_context(dc, null, compressed,
+                sizeof(compressed), data, 100, &written) != EINVAL) {
+            rt_println("context limits are not checked");
+            r = EINVAL;
+        }
+    }
+    rt_assert(r == 0);
+    lz77.context_dispose(dc);
+    lz77.context_dispose(placed);
+    lz77.context_dispose(created);
+    lz77.dictionary_dispose(half);
+    lz77.dictionary_dispose(dictionary);
+    return r;
+}
+
+static errno_t test_batch(void) {
+    // messages compressed on threads are the same as one by one and
+    // errors stay with the messages they belong to
+    enum { count = 200, capacity = 512 };
+    static uint8_t data[16 * 1024];
+    static char record[count][256];
+    static uint8_t compressed[count][capacity];
+    static lz77_message_t m[count];
+    size_t n = 0;
+    for (uint32_t k = 0; n < sizeof(data) - 256; k++) {
+        n += test_record((char*)data + n, sizeof(data) - n, k);
+    }
+    lz77_dictionary_t* dictionary = null;
+    errno_t r = lz77.dictionary_create(&dictionary, data, n, lzn_window_bits);
+    for (int with = 0; with <= 1 && r == 0; with++) {
+        lz77_dictionary_t* d = with ? dictionary : null;
+        for (uint32_t k = 0; k < count; k++) {
+            const size_t length = k == 7 ? 0 :
+                test_record(record[k], sizeof(record[k]), 1000 + k);
+            m[k] = (lz77_message_t){ .data = (uint8_t*)record[k],
+                .bytes = length, .compressed = compressed[k],
+                .capacity = k == 42 ? 16 : capacity };
+        }
+        errno_t e = lz77.compress_batch(d, lzn_window_bits, level, m, count,
+                                        3);
+        if (e != ENOBUFS || m[42].error != ENOBUFS || m[42].written != 0) {
+            rt_println("compress_batch() error: %s", strerror(e));
+            r = EINVAL;
+        }
+        for (uint32_t k = 0; k < count && r == 0; k++) {
+            uint8_t expected[capacity];
+            size_t written = 0;
+            if (k == 42) { continue; }
+            r = m[k].error;
+            if (r == 0 && d != null) {
+                r = lz77.compress_dictionary(d, expected, capacity,
+                        m[k].data, m[k].bytes, level, &written);
+            } else if (r == 0) {
+                r = lz77.compress_buffer(expected, capacity, m[k].data,
+                        m[k].bytes, lzn_window_bits, &written);
+            }
+            if (r == 0 && (written != m[k].written ||
+                           memcmp(expected, compressed[k], written) != 0)) {
+                rt_println("compress_batch() is not the same");
+                r = ENODATA;
+            }
+        }
+    }
+    if (r == 0 && lz77.compress_batch(dictionary, lzn_window_bits + 1,
+                                      level, m, count, 3) != EINVAL) {
+        r = EINVAL; // window of the dictionary differs
+    }
+    rt_assert(r == 0);
+    lz77.dictionary_dispose(dictionary);
+    return r;
+}
+
+static errno_t test_far(void) {
+    // repeat farther than 1MB is found only with the larger window,
+    // with the smaller one compress() stores the message as is
+    enum { mb = 1024 * 1024, bytes = 3 * mb };
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* data = (uint8_t*)malloc(bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(bytes);
+    errno_t r = data && compressed && decompressed ? 0 : ENOMEM;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < 2 * mb && r == 0; i++) {
+        seed = seed * 1664525 + 1013904223; // LCG
+        data[i] = (uint8_t)(seed >> 24);
+    }
+    if (r == 0) { memcpy(data + 2 * mb, data, mb); }
+    size_t written[2] = {0};
+    for (int k = 0; k < 2 && r == 0; k++) {
+        const uint8_t window_bits = k == 0 ? 20 : 22;
+        lz77_t lz = { .buffer = compressed, .capacity = capacity };
+        lz77.write_header(&lz, bytes, window_bits);
+        if (k == 0) {
+            lz77.compress(&lz, data, bytes, window_bits);
+        } else {
+            lz77.compress_level(&lz, data, bytes, window_bits,
+                                lz77_level_min);
+        }
+        r = lz.error;
+        written[k] = lz.bytes;
+        size_t n = 0;
+        if (r == 0) {
+            r = lz77.decompress_buffer(decompressed, bytes, compressed,
+                                       lz.bytes, &n);
+        }
+        if (r == 0 && (n != bytes || memcmp(data, decompressed, n) != 0)) {
+            rt_println("window_bits %d: compress() and decompress() "
+                       "are not the same", window_bits);
+            r = ENODATA;
+        }
+    }
+    if (r == 0) {
+        rt_println("%d bytes: %lld window_bits 20, %lld window_bits 22",
+                   bytes, written[0], written[1]);
+        if (written[0] > bytes + 32 || written[1] + mb * 3 / 4 > written[0]) {
+            r = EINVAL;
+        }
+    }
+    if (r == 0) { // far matching is single format only
+        lz77_dictionary_t* d = null;
+        lz77_context_t* c = null;
+        lz77_t lz = { .buffer = compressed, .capacity = capacity };
+        lz77.compress_begin(&lz, 22, level);
+        lz77.compress_finish(&lz);
+        if (lz.error != EINVAL ||
+            lz77.dictionary_create(&d, data, mb, 22) != EINVAL ||
+            lz77.context_create(&c, 22, level, 0) != EINVAL) {
+            rt_println("window_bits 22 is not rejected");
+            r = EINVAL;
+        }
+    }
+    rt_assert(r == 0);
+    free(data);
+    free(compressed);
+    free(decompressed);
+    return r;
+}
+
+static errno_t test_auto(void) {
+    // the only repeats are 96KB back: window of 128KB reaches them
+    enum { kb = 1024, bytes = 256 * kb, distance = 96 * kb };
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* data = (uint8_t*)malloc(bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(bytes);
+    errno_t r = data && compressed && decompressed ? 0 : ENOMEM;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < bytes && r == 0; i++) {
+        seed = seed * 1664525 + 1013904223; // LCG
+        data[i] = i < distance ? (uint8_t)(seed >> 24) : data[i - distance];
+    }
+    if (r == 0 && (lz77.auto_window_bits(data, bytes) != 17 ||
+                   lz77.auto_window_bits(data, distance) != 10)) {
+        rt_println("auto_window_bits() is not as expected");
+        r = EINVAL;
+    }
+    for (int k = 0; k < 3 && r == 0; k++) {
+        size_t written = 0;
+        if (k == 0) {
+            r = lz77.compress_buffer(compressed, capacity, data, bytes,
+                                     lz77_window_auto, &written);
+        } else { // one block of lz77_block_lz type with its own bases
+            // and with 1MB stream window its own window of 128KB
+            lz77_t lz = { .buffer = compressed, .capacity = capacity };
+            lz77.compress_parallel(&lz, data, bytes,
+                                   k == 1 ? lz77_window_auto : 20,
+                                   lz77_level_min, k == 1 ? 18 : 20,
+                                   false, 1);
+            r = lz.error;
+            written = lz.bytes;
+        }
+        uint64_t w[2] = {0}; // window_bits word and the first block header
+        if (r == 0) { memcpy(w, compressed + 8, sizeof(w)); }
+        if (r == 0 && (uint8_t)w[0] != (k == 2 ? 20 : 17)) { r = EINVAL; }
+        if (r == 0 && k > 0 &&
+            ((uint8_t)w[1] != 1 || (uint8_t)(w[1] >> 16) == 0)) {
+            r = EINVAL;
+        }
+        if (r == 0 && k == 2 && (uint8_t)(w[1] >> 24) != 17) { r = EINVAL; }
+        for (int bad = 9; bad <= 20 && r == 0 && k == 2; bad += 11) {
+            size_t n = 0; // block window must be in [10..window_bits - 1]
+            compressed[19] = (uint8_t)bad;
+            if (lz77.decompress_buffer(decompressed, bytes, compressed,
+                                       written, &n) != EINVAL) {
+                r = EINVAL;
+            }
+            compressed[19] = 17;
+        }
+        if (r == EINVAL) {
+            rt_println("lz77_window_auto: unexpected header");
+        }
+        size_t n = 0;
+        if (r == 0) {
+            r = lz77.decompress_buffer(decompressed, bytes, compressed,
+                                       written, &n);
+        }
+        if (r == 0 && (n != bytes || memcmp(data, decompressed, n) != 0)) {
+            rt_println("lz77_window_auto: compress() and decompress() "
+                       "are not the same");
+            r = ENODATA;
+        }
+        if (r == 0 && written > bytes - distance + distance / 16) {
+            rt_println("lz77_window_auto: %d bytes -> %lld", bytes, written);
+            r = EINVAL;
+        }
+    }
+    rt_assert(r == 0);
+    free(data);
+    free(compressed);
+    free(decompressed);
+    return r;
+}
+
+static errno_t test_reps(void) {
+    // 32 byte records repeat 1KB back with one byte changed: the match
+    // after each changed byte is coded as a repeat offset
+    enum { bytes = 64 * 1024, stride = 1024 };
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* data = (uint8_t*)malloc(bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(bytes);
+    errno_t r = data && compressed && decompressed ? 0 : ENOMEM;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < bytes && r == 0; i++) {
+        seed = seed * 1664525 + 1013904223; // LCG
+        data[i] = i < stride || i % 32 == (seed >> 27) ?
+            (uint8_t)(seed >> 16) : data[i - stride];
+    }
+    size_t sizes[3] = {0}; // at levels 1, 5 and 9
+    for (int k = 0; k < 4 && r == 0; k++) {
+        static const int levels[] = { 1, 5, 9, 1 };
+        lz77_t lz = { .buffer = compressed, .capacity = capacity };
+        const size_t size = k == 3 ? stride : bytes;
+        lz77.write_header(&lz, size, 16);
+        lz77.compress_level(&lz, data, size, 16, levels[k]);
+        r = lz.error;
+        size_t n = 0;
+        if (r == 0 && k == 3) { // literals only: same as version 0
+            rt_assert((compressed[16] >> 5) == 2); // version
+            rt_assert(compressed[17] == 0);        // flags
+            memmove(compressed + 17, compressed + 18, lz.bytes - 18);
+            compressed[lz.bytes - 1] = 0;
+            compressed[16] = 16;
+            r = lz77.decompress_buffer(decompressed, bytes, compressed,
+                                       lz.bytes, &n);
+            if (r == 0) { rt_assert(n == stride); }
+            compressed[16] = 16 | (7 << 5); // future version
+            if (r == 0 && lz77.decompress_buffer(decompressed, bytes,
+                    compressed, lz.bytes, &n) != EINVAL) {
+                rt_println("future version is not rejected");
+                r = EINVAL;
+            }
+        } else if (r == 0) {
+            r = lz77.decompress_buffer(decompressed, bytes, compressed,
+                                       lz.bytes, &n);
+            if (r == 0 && (n != bytes || memcmp(data, decompressed, n))) {
+                rt_println("level %d: compress() and decompress() "
+                           "are not the same", levels[k]);
+                r = ENODATA;
+            }
+            if (r == 0) {
+                rt_println("level %d: %d bytes -> %lld", levels[k], bytes,
+                           lz.bytes);
+                sizes[k] = lz.bytes;
+            }
+        }
+    }
+    if (r == 0 && (sizes[2] > sizes[1] || sizes[1] > sizes[0])) {
+        rt_println("higher level compresses worse");
+        r = EINVAL;
+    }
+    rt_assert(r == 0);
+    free(data);
+    free(compressed);
+    free(decompressed);
+    return r;
+}
+
+static errno_t test_stored(void) {
+    // random messages are stored by every single format API with the
+    // header as the only overhead and still round trip
+    enum { capacity = 64 * 1024 + 64, count = 3 };
+    static const size_t sizes[count] = { 100, 5000, 64 * 1024 };
+    static uint8_t data[64 * 1024];
+    static uint8_t compressed[count][capacity];
+    static uint8_t decompressed[64 * 1024];
+    static char text[4 * 1024];
+    uint32_t seed = 1;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        seed = seed * 1664525 + 1013904223; // LCG
+        data[i] = (uint8_t)(seed >> 24);
+    }
+    size_t n = 0;
+    for (uint32_t k = 0; n < sizeof(text) - 256; k++) {
+        n += test_record(text + n, sizeof(text) - n, k);
+    }
+    lz77_dictionary_t* dictionary = null;
+    lz77_context_t* c = null;
+    errno_t r = lz77.dictionary_create(&dictionary, (uint8_t*)text, n,
+                                       lzn_window_bits);
+    if (r == 0) {
+        r = lz77.context_create(&c, lzn_window_bits, level,
+                                (1 << lzn_window_bits) + sizeof(data));
+    }
+    for (int api = 0; api < 5 && r == 0; api++) {
+        // buffer, context, context with dictionary, batch with and without
+        const lz77_dictionary_t* d = api == 2 || api == 4 ? dictionary : null;
+        size_t written[count] = {0};
+        if (api >= 3) {
+            lz77_message_t m[count];
+            for (int k = 0; k < count; k++) {
+                m[k] = (lz77_message_t){ .data = data, .bytes = sizes[k],
+                    .compressed = compressed[k], .capacity = capacity };
+            }
+            r = lz77.compress_batch(d, lzn_window_bits, level, m, count, 2);
+            for (int k = 0; k < count; k++) { written[k] = m[k].written; }
+        }
+        for (int k = 0; k < count && r == 0 && api < 3; k++) {
+            r = api == 0 ?
+                lz77.compress_buffer(compressed[k], capacity, data,
+                    sizes[k], lzn_window_bits, &written[k]) :
+                lz77.compress_context(c, d, compressed[k], capacity, data,
+                    sizes[k], &written[k]);
+        }
+        for (int k = 0; k < count && r == 0; k++) {
+            if (written[k] > sizes[k] + 32) {
+                rt_println("stored: %lld bytes -> %lld", sizes[k],
+                           written[k]);
+                r = EINVAL;
+            }
+            if (r == 0) {
+                r = d != null ?
+                    lz77.decompress_dictionary(d, decompressed,
+                        sizeof(decompressed), compressed[k], written[k],
+                        &n) :
+                    lz77.decompress_buffer(decompressed,
+                        sizeof(decompressed), compressed[k], written[k],
+                        &n);
+            }
+            if (r == 0 && (n != sizes[k] || memcmp(data, decompressed, n))) {
+                r = ENODATA;
+            }
+        }
+    }
+    rt_assert(r == 0);
+    lz77.context_dispose(c);
+    lz77.dictionary_dispose(dictionary);
+    return r;
+}
+
+static errno_t test_checksum(void) {
+    // random first block is stored: a flipped byte of it decodes fine
+    // but does not match the checksum
+    enum { kb = 1024, bytes = 256 * kb, block = 64 * kb };
+    const size_t capacity = lz77.compress_bound(bytes);
+    uint8_t* data = (uint8_t*)malloc(bytes);
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* decompressed = (uint8_t*)malloc(bytes);
+    errno_t r = data && compressed && decompressed ? 0 : ENOMEM;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < bytes && r == 0; i++) {
+        seed = seed * 1664525 + 1013904223; // LCG
+        data[i] = i < block ? (uint8_t)(seed >> 24) : "checksum"[seed >> 29];
+    }
+    for (int k = 0; k < 2 && r == 0; k++) {
+        lz77_t lz = { .buffer = compressed, .capacity = capacity,
+                      .checksum = true };
+        if (k == 0) {
+            lz77.compress_begin(&lz, 16, lz77_level_min);
+            lz77.compress_update(&lz, data, bytes);
+            lz77.compress_finish(&lz);
+        } else {
+            lz77.compress_parallel(&lz, data, bytes, 16, lz77_level_min, 16,
+                                   true, 2);
+        }
+        r = lz.error;
+        size_t n = 0;
+        if (r == 0) {
+            r = lz77.decompress_buffer(decompressed, bytes, compressed,
+                                       lz.bytes, &n);
+        }
+        if (r == 0 && (n != bytes || memcmp(data, decompressed, n) != 0)) {
+            r = ENODATA;
+        }
+        // stream header, block header and a byte in the first stored word
+        const size_t stored = 32 + 5;
+        const int checks = k == 0 ? 3 : 5; // decoders of the stream
+        errno_t e[5] = {0};
+        if (r == 0) {
+            compressed[stored] ^= 0x20;
+            e[0] = lz77.decompress_buffer(decompressed, bytes, compressed,
+                                          lz.bytes, &n);
+            lz77_t lr = { .buffer = compressed, .bytes = lz.bytes };
+            lz77.decompress_begin(&lr);
+            (void)lz77.decompress_read(&lr, decompressed, bytes);
+            lz77.decompress_finish(&lr);
+            e[1] = lr.error;
+            if (k == 1) {
+                e[3] = lz77.decompress_parallel(decompressed, bytes,
+                            compressed, lz.bytes, 2, &n);
+                e[4] = lz77.decompress_range(decompressed, compressed,
+                                             lz.bytes, 0, 1);
+            }
+            compressed[stored] ^= 0x20;
+        }
+        const size_t end = lz.bytes - 12; // stream checksum of end block
+        if (r == 0) {
+            compressed[end] ^= 0x01;
+            e[2] = lz77.decompress_buffer(decompressed, bytes, compressed,
+                                          lz.bytes, &n);
+            compressed[end] ^= 0x01;
+        }
+        for (int i = 0; i < checks && r == 0; i++) {
+            if (e[i] != EBADMSG) {
+                rt_println("corrupted data is not detected: %d %d", k, i);
+                r = EINVAL;
+            }
+        }
+    }
+    // single format: stored random block and compressed whole data
+    for (int k = 0; k < 2 && r == 0; k++) {
+        const size_t n = k == 0 ? block : bytes;
+        size_t written = 0;
+        r = lz77.compress_buffer_ex(compressed, capacity, data, n, 16,
+                                    true, &written);
+        if (r == 0 && (compressed[17] & 2) == 0) { r = EINVAL; }
+        size_t m = 0;
+        if (r == 0) {
+            r = lz77.decompress_buffer(decompressed, n, compressed,
+                                       written, &m);
+        }
+        if (r == 0 && (m != n || memcmp(data, decompressed, m) != 0)) {
+            r = ENODATA;
+        }
+        // a byte of the stored message or of the trailing checksum
+        const size_t at = k == 0 ? 24 + 5 : written - 3;
+        errno_t e[2] = {0};
+        if (r == 0) {
+            compressed[at] ^= 0x20;
+            e[0] = lz77.decompress_buffer(decompressed, n, compressed,
+                                          written, &m);
+            lz77_t lr = { .buffer = compressed, .bytes = written };
+            lz77.decompress_begin(&lr);
+            (void)lz77.decompress_read(&lr, decompressed, n);
+            lz77.decompress_finish(&lr);
+            e[1] = lr.error;
+            compressed[at] ^= 0x20;
+        }
+        for (int i = 0; i < 2 && r == 0; i++) {
+            if (e[i] != EBADMSG) {
+                rt_println("corrupted message is not detected: %d %d", k, i);
+                r = EINVAL;
+            }
+        }
+    }
+    rt_assert(r == 0);
+    free(data);
+    free(compressed);
+    free(decompressed);
+    return r;
 }
 
 static errno_t test(const uint8_t* data, size_t bytes) {
@@ -178,17 +1089,33 @@ static errno_t test(const uint8_t* data, size_t bytes) {
         r = verify(compressed, data, bytes);
     }
     (void)remove(compressed);
+    if (r == 0) {
+        r = test_buffer(data, bytes);
+    }
+    if (r == 0) {
+        r = test_stream(data, bytes);
+    }
+    if (r == 0) {
+        r = test_parallel(data, bytes);
+    }
+    if (r == 0) {
+        r = test_stats(data, bytes);
+    }
     return r;
 }
 
 static errno_t test_compression(const char* fn) {
-    errno_t r = 0;
-    uint8_t* data = null;
+    const uint8_t* data = null;
     size_t bytes = 0;
-    r = read_whole_file(fn, &data, &bytes);
-    if (r != 0) { return r; }
+    errno_t r = rt_map_file(fn, &data, &bytes); // no heap copy of the input
+    if (r != 0) {
+        rt_println("Failed to map file \"%s\": %s", fn, strerror(r));
+        return r;
+    }
     input_file = fn;
-    return test(data, bytes);
+    r = test(data, bytes);
+    (void)rt_unmap_file(data, bytes);
+    return r;
 }
 
 int main(int argc, const char* argv[]) {
@@ -203,14 +1130,90 @@ int main(int argc, const char* argv[]) {
         }
         r = test(data, sizeof(data));
     }
+    if (r == 0) { // overlapped matches with short periods
+        uint8_t data[1000] = {0};
+        for (int32_t period = 2; period <= 17 && r == 0; period++) {
+            for (size_t i = 0; i < sizeof(data); i++) {
+                data[i] = (uint8_t)(0x41 + i % period);
+            }
+            r = test(data, sizeof(data));
+        }
+    }
+    if (r == 0) { // bytes >= 0x80 are encoded with `10` flags
+        uint8_t data[4096];
+        for (size_t i = 0; i < sizeof(data); i++) {
+            data[i] = (uint8_t)(i * i / 7);
+        }
+        r = test(data, sizeof(data));
+    }
+    if (r == 0) { // incompressible data must fit into compress_bound()
+        static uint8_t data[64 * 1024];
+        uint32_t seed = 1;
+        for (size_t i = 0; i < sizeof(data); i++) {
+            seed = seed * 1664525 + 1013904223; // LCG
+            data[i] = (uint8_t)(seed >> 24);
+        }
+        r = test(data, sizeof(data));
+    }
+    if (r == 0) { // streams longer than a few blocks slide the window
+        static uint8_t data[300 * 1024];
+        uint32_t seed = 1;
+        uint32_t distance = 1;
+        for (size_t i = 0; i < sizeof(data); i++) {
+            seed = seed * 1664525 + 1013904223; // LCG
+            // random bytes start runs copied from up to 2KB back
+            if (i < 2048 || (seed >> 28) == 0) {
+                data[i] = (uint8_t)(seed >> 16);
+                distance = 1 + (seed >> 8) % 2047;
+            } else {
+                data[i] = data[i - distance];
+            }
+        }
+        r = test(data, sizeof(data));
+    }
+    if (r == 0) {
+        r = test_dictionary();
+    }
+    if (r == 0) {
+        r = test_context();
+    }
+    if (r == 0) {
+        r = test_batch();
+    }
+    if (r == 0) {
+        r = test_far();
+    }
+    if (r == 0) {
+        r = test_auto();
+    }
+    if (r == 0) {
+        r = test_reps();
+    }
+    if (r == 0) {
+        r = test_stored();
+    }
+    if (r == 0) {
+        r = test_checksum();
+    }
     if (r == 0) {
         const char* data = "Hello World Hello.World Hello World";
         size_t bytes = strlen((const char*)data);
         r = test((const uint8_t*)data, bytes);
     }
  #ifdef FILE_NAME
+    for (level = lz77_level_min; level <= lz77_level_max && r == 0; level++) {
+        r = test_compression(FILE_NAME);
+    }
+    level = lz77_level_default;
+    if (r == 0) {
+        block_io = false;
+        r = test_compression(FILE_NAME);
+        block_io = true;
+    }
     if (r == 0) {
+        pipelined = true;
         r = test_compression(FILE_NAME);
+        pipelined = false;
     }
 #endif
     if (file_exist("test/ut.h")) {
@@ -228,8 +1231,7 @@ int main(int argc, const char* argv[]) {
 #define lz77_assert(b, ...) rt_assert(b, __VA_ARGS__)
 #define lz77_println(...)   rt_println(__VA_ARGS__)
 
-#define lz77_historgram // to dump histograms on compress
-#undef  lz77_historgram // no histograms
+#define lz77_statistics // lz77_t.stats for test_stats()
 
 #define lz77_implementation // this will include the implementation of lz77
 #include "lz77.h"